@@ -0,0 +1,269 @@
+/*
+ * Микробенчмарк горячих путей graph.
+ *
+ * Для каждого графа корпуса и каждого способа вычисления замеряются set_edges()
+ * (для paths это make_matrix_traj()), get_matrix_amplitude(), get_matrix_truth(),
+ * get_deviation(), get_deviation(grad), sift() и полный запуск NLopt().
+ * Корпус: граф 6 портов / 5 светоделителей из main.cpp и случайные графы
+ * для каждого размера из аргументов.
+ *
+ * Аргументы: [опции] [p,bs,dc,w ...]  (по умолчанию 4,1,1,1 4,2,1,0 6,5,0,0)
+ *  -n n        случайных графов на размер (по умолчанию 3)
+ *  -r n        замеров на операцию (по умолчанию 5)
+ *  -T сек      минимальное время замера (по умолчанию 0.02)
+ *  -e список   способы вычисления через запятую (по умолчанию paths,transfer,tape,static)
+ *  -x n        зерно генератора графов
+ *  -N          без замера NLopt()
+ *
+ * Результат - JSON на стандартный вывод:
+ *  {"benchmarks": [{"name", "graph", "size": [p, bs, dc, w], "engine",
+ *    "ns_per_op", "variance", "stddev", "samples", "iterations"}, ...]}
+ * Среднее и выборочная дисперсия считаются по замерам, в каждом из которых
+ * операция повторяется iterations раз.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <unistd.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "graph.hpp"
+#include "optimize.hpp"
+
+//! Граф корпуса
+struct bench_graph_t
+{
+    std::string name;
+    uint p, bs, dc, w;
+    std::vector<uint> edges;
+};
+
+//! Результат замера: среднее и дисперсия времени одной операции, нс
+struct bench_result_t
+{
+    double mean;
+    double variance;
+    uint samples;
+    size_t iterations;
+};
+
+//! Результат операции копится здесь, чтобы компилятор не выбросил вызовы
+static volatile double sink;
+
+/*
+ * @brief Замеряет _f: число повторов подбирается удвоением, пока замер
+ *  не займёт _minTime, затем делается _samples замеров
+ */
+static bench_result_t measure(const std::function<double()> &_f, uint _samples, double _minTime)
+{
+    using namespace std::chrono;
+
+    auto run = [&](size_t _n)
+    {
+        const steady_clock::time_point t0 = steady_clock::now();
+        double s = 0;
+        for(size_t i = 0; i < _n; ++i)
+        s += _f();
+        sink = sink + s;
+        return duration<double>(steady_clock::now() - t0).count();
+    };
+
+    size_t n = 1;
+    while(run(n) < _minTime && n < (size_t(1) << 30))
+    n *= 2;
+
+    std::vector<double> ns(_samples);
+    for(uint s = 0; s < _samples; ++s)
+    ns[s] = run(n) / n * 1e9;
+
+    bench_result_t r;
+    r.samples = _samples;
+    r.iterations = n;
+    r.mean = 0;
+    for(auto x : ns) r.mean += x;
+    r.mean /= _samples;
+
+    r.variance = 0;
+    for(auto x : ns) r.variance += (x - r.mean) * (x - r.mean);
+    r.variance = (_samples > 1) ? r.variance / (_samples - 1) : 0;
+
+    return r;
+}
+
+/*
+ * @brief Случайный граф того же вида, что строит сифтер: оба входа оператора k
+ *  питаются портами ввода или выходами операторов с меньшими номерами,
+ *  поэтому граф ациклический и в каждый узел смотрит ровно одно ребро
+ */
+static std::vector<uint> random_graph(uint _p, uint _n, std::mt19937 &_rng)
+{
+    const uint q = 2*_n;
+    std::vector<uint> edges(q + _p);
+
+    //! Ещё не подключённые источники: порты ввода и выходы операторов
+    std::vector<uint> pool;
+    for(uint i = 0; i < _p; ++i)
+    pool.push_back(q + i);
+
+    for(uint k = 0; k < _n; ++k)
+    {
+        for(uint in = 0; in < 2; ++in)
+        {
+            const size_t s = std::uniform_int_distribution<size_t>(0, pool.size() - 1)(_rng);
+            edges[pool[s]] = 2*k + in;
+            pool.erase(pool.begin() + s);
+        }
+
+        pool.push_back(2*k);
+        pool.push_back(2*k + 1);
+    }
+
+    std::shuffle(pool.begin(), pool.end(), _rng);
+    for(uint j = 0; j < _p; ++j)
+    edges[pool[j]] = q + j;
+
+    return edges;
+}
+
+int main(int argc, char ** argv)
+{
+    using namespace std;
+
+    uint randomGraphs = 3, samples = 5;
+    double minTime = 0.02;
+    unsigned seed = 1;
+    bool nlopt = true;
+    vector<string> engineNames = {"paths", "transfer", "tape", "static"};
+    {
+        int opt;
+        while((opt = getopt(argc, argv, "n:r:T:e:x:N")) != -1)
+        switch(opt)
+        {
+            case 'n': randomGraphs = stoi(string(optarg)); break;
+            case 'r': samples = max(stoi(string(optarg)), 1); break;
+            case 'T': minTime = stod(string(optarg)); break;
+            case 'x': seed = stoul(string(optarg)); break;
+            case 'N': nlopt = false; break;
+            case 'e':
+            {
+                engineNames.clear();
+                stringstream list(optarg);
+                string e;
+                while(getline(list, e, ','))
+                engineNames.push_back(e);
+                break;
+            }
+            default: return 3;
+        }
+    }
+
+    vector<graph::engines_types> engines;
+    for(auto &e : engineNames)
+    {
+        graph::engines_types t;
+        if(!parse_engine(e, t))
+        {
+            cerr << "Unknown engine: " << e << endl;
+            return 3;
+        }
+        engines.push_back(t);
+    }
+
+    vector<bench_graph_t> corpus;
+    corpus.push_back(bench_graph_t{"main", 6, 5, 0, 0, {10,15,4,6,8,11,9,14,12,13,0,5,2,3,7,1}});
+
+    vector<string> sizes;
+    for(int a = optind; a < argc; ++a) sizes.push_back(argv[a]);
+    if(sizes.empty()) sizes = {"4,1,1,1", "4,2,1,0", "6,5,0,0"};
+
+    mt19937 rng(seed);
+    for(auto &s : sizes)
+    {
+        uint p, bs, dc, w;
+        char c;
+        stringstream in(s);
+        if(!(in >> p >> c >> bs >> c >> dc >> c >> w) || p < 4)
+        {
+            cerr << "Bad size: " << s << endl;
+            return 1;
+        }
+
+        for(uint k = 0; k < randomGraphs; ++k)
+        corpus.push_back(bench_graph_t{"random" + to_string(k), p, bs, dc, w, random_graph(p, bs + dc + w, rng)});
+    }
+
+    cout << "{\"benchmarks\": [";
+    bool first = true;
+
+    for(auto &bg : corpus)
+    {
+        // Целевая матрица - CNOT в портах 0..3, как в примерах оптимизатора
+        graph::cmatrix_t tM(bg.p, vector<complex<double> >(bg.p, 0.));
+        tM[0][0] = tM[1][1] = tM[2][3] = tM[3][2] = 1.;
+
+        graph::smatrix_t sM(bg.p, vector<bool>(bg.p, false));
+        for(uint i = 0; i < 4; ++i)
+        for(uint j = 0; j < 4; ++j)
+        sM[i][j] = (i < 2) == (j < 2);
+
+        for(size_t e = 0; e < engines.size(); ++e)
+        {
+            graph g(bg.p, bg.bs, bg.dc, bg.w);
+            g.set_engine(engines[e]);
+            g.set_target_matrix(tM);
+            g.set_edges(bg.edges);
+
+            vector<double> x = g.get_variables();
+            for(size_t k = 0; k < x.size(); ++k)
+            x[k] = 0.1 + 0.8 * k / max<size_t>(x.size(), 1);
+            g.set_variables(x);
+
+            vector<double> grad;
+
+            vector<pair<string, function<double()> > > ops = {
+                {"set_edges", [&]() { g.set_edges(bg.edges); return 0.; }},
+                {"get_matrix_amplitude", [&]() { return real(g.get_matrix_amplitude()[0][0]); }},
+                {"get_matrix_truth", [&]() { return real(g.get_matrix_truth()[0][0]); }},
+                {"get_deviation", [&]() { return g.get_deviation(); }},
+                {"get_deviation_grad", [&]() { return g.get_deviation(grad); }},
+                {"sift", [&]() { return double(g.sift(sM)); }}
+            };
+
+            if(nlopt)
+            ops.push_back({"NLopt", [&]() {
+                graph h = g;
+                h.set_edges(bg.edges);
+                NLopt(h, 1e-2);
+                return h.get_deviation();
+            }});
+
+            for(auto &op : ops)
+            {
+                const bench_result_t r = measure(op.second, samples, minTime);
+
+                cout << (first ? "\n" : ",\n") << "  {\"name\": \"" << op.first
+                    << "\", \"graph\": \"" << bg.name
+                    << "\", \"size\": [" << bg.p << ", " << bg.bs << ", " << bg.dc << ", " << bg.w
+                    << "], \"engine\": \"" << engineNames[e]
+                    << "\", \"ns_per_op\": " << r.mean
+                    << ", \"variance\": " << r.variance
+                    << ", \"stddev\": " << sqrt(r.variance)
+                    << ", \"samples\": " << r.samples
+                    << ", \"iterations\": " << r.iterations << "}";
+                cout.flush();
+                first = false;
+            }
+        }
+    }
+
+    cout << "\n]}" << endl;
+
+    return 0;
+}
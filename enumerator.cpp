@@ -0,0 +1,334 @@
+#ifndef ENUMERATOR_CPP
+#define ENUMERATOR_CPP
+
+#include <algorithm>
+
+#include "enumerator.hpp"
+
+enumerator::enumerator(uint ports, uint beamsplitters, uint directCouplers, uint waveplates)
+{
+	p = ports;
+	q = 2*(beamsplitters + directCouplers + waveplates);
+	n = q + p;
+
+	visited = leaves = pruned = symmetric = sifted = 0;
+	sP = 0;
+	busy = 0;
+
+	e.resize(n);
+	cand.resize(n + 1);
+
+	out.resize(n + 1);
+	free_out.resize(n + 1);
+	in.resize(n);
+	reach.resize(p);
+	relabeled.resize(n);
+}
+
+void enumerator::set_symmetries(const std::vector<std::vector<uint> > &_perms)
+{
+	perms = _perms;
+}
+
+void enumerator::run(
+	const std::vector<uint> &_templ,
+	uint _sP,
+	graph &_g,
+	const graph::smatrix_t &_sM,
+	const visit_t &_visit)
+{
+	run(subtree_t{_templ, 0}, _sP, _g, _sM, _visit);
+}
+
+void enumerator::load(const std::vector<uint> &_e, uint _depth, uint _sP)
+{
+	sP = _sP;
+	std::copy(_e.begin(), _e.end(), e.begin());
+
+	// Заготовка назначает порты ввода sP .. p - 1, то есть исходящие узлы q + sP .. n - 1
+	busy = 0;
+	for(uint s = q + sP; s < n; ++s)
+	busy |= u_int64_t(1) << e[s];
+	for(uint s = 0; s < _depth; ++s)
+	busy |= u_int64_t(1) << e[s];
+}
+
+bool enumerator::split(
+	const subtree_t &_s,
+	uint _sP,
+	graph &_g,
+	std::vector<subtree_t> &_children)
+{
+	load(_s.e, _s.depth, _sP);
+
+	const uint last = q + sP;
+	const uint d = _s.depth;
+	if(d == last) return false;
+
+	if(!reachable(d, _g))
+	{
+		++pruned;
+		return true;
+	}
+
+	const u_int64_t all = (n == 64) ? ~u_int64_t(0) : (u_int64_t(1) << n) - 1;
+	const uint first = d < q ? (d / 2) * 2 + 2 : 0;
+	if(first >= n) return true;
+
+	for(u_int64_t avail = ~busy & all & (~u_int64_t(0) << first); avail != 0; avail &= avail - 1)
+	{
+		const uint x = __builtin_ctzll(avail);
+		e[d] = x;
+		busy |= u_int64_t(1) << x;
+		++visited;
+
+		if(d + 1 < last && !reachable(d + 1, _g))
+		++pruned;
+		else
+		_children.push_back(subtree_t{e, d + 1});
+
+		busy &= ~(u_int64_t(1) << x);
+	}
+
+	return true;
+}
+
+void enumerator::run(
+	const subtree_t &_s,
+	uint _sP,
+	graph &_g,
+	const graph::smatrix_t &_sM,
+	const visit_t &_visit)
+{
+	load(_s.e, _s.depth, _sP);
+
+	//! Число исходящих узлов, назначаемых перебором: выходы операторов и порты ввода до sP
+	const uint last = q + sP;
+	const u_int64_t all = (n == 64) ? ~u_int64_t(0) : (u_int64_t(1) << n) - 1;
+
+	//! Первый узел, куда может смотреть исходящий узел s
+	auto first = [&](uint s) { return s < q ? (s / 2) * 2 + 2 : 0; };
+
+	//! Первое ребро, назначаемое перебором; рёбра до него заданы поддеревом
+	const int top = _s.depth;
+
+	if(uint(top) < last && !reachable(top, _g))
+	{
+		++pruned;
+		return;
+	}
+
+	// d - исходящий узел, которому подбирается ребро; рёбра e[0..d) назначены
+	int d = top;
+	cand[d] = first(d);
+	while(d >= top)
+	{
+		if(uint(d) == last)
+		{
+			// Все узлы заняты: e - полностью построенный направленный граф
+			++leaves;
+			_g.set_edges(e);
+
+			if(_g.sift(_sM))
+			{
+				if(!perms.empty() && !canonical())
+				++symmetric;
+				else
+				{
+					++sifted;
+					_visit(e);
+				}
+			}
+
+			if(--d >= top) busy &= ~(u_int64_t(1) << e[d]);
+			continue;
+		}
+
+		const u_int64_t avail = (cand[d] < n) ? ~busy & all & (~u_int64_t(0) << cand[d]) : 0;
+		if(avail == 0)
+		{
+			// Кандидаты для d кончились - откат
+			if(--d >= top) busy &= ~(u_int64_t(1) << e[d]);
+			continue;
+		}
+
+		const uint x = __builtin_ctzll(avail);
+		e[d] = x;
+		cand[d] = x + 1;
+		busy |= u_int64_t(1) << x;
+		++visited;
+
+		if(uint(d) + 1 < last && !reachable(d + 1, _g))
+		{
+			++pruned;
+			busy &= ~(u_int64_t(1) << x);
+			continue;
+		}
+
+		++d;
+		cand[d] = first(d);
+	}
+}
+
+bool enumerator::reachable(uint me, graph &_g)
+{
+	//! Первый исходящий узел, назначенный в заготовке: порты ввода q + sP .. p - 1
+	const uint firstFixed = q + sP;
+
+	//! Назначено ли ребро из исходящего узла s
+	auto assigned = [&](uint s) { return s < me || s >= firstFixed; };
+	auto is_busy = [&](uint x) { return (busy >> x) & 1; };
+
+	// Обратный проход: out[x] - маска портов вывода, достижимых из узла x,
+	// free_out[x] - объединение out[] по свободным узлам с номером >= x
+	free_out[n] = 0;
+	for(uint x = n; x-- > q;)
+	{
+		out[x] = u_int64_t(1) << (x - q);
+		free_out[x] = free_out[x + 1] | (is_busy(x) ? 0 : out[x]);
+	}
+
+	for(uint k = q / 2; k-- > 0;)
+	{
+		u_int64_t m = 0;
+		for(uint s = 2*k; s < 2*k + 2; ++s)
+		m |= assigned(s) ? out[e[s]] : free_out[2*k + 2];
+
+		if(m == 0) return false;
+
+		out[2*k] = out[2*k + 1] = m;
+		free_out[2*k + 1] = free_out[2*k + 2] | (is_busy(2*k + 1) ? 0 : m);
+		free_out[2*k] = free_out[2*k + 1] | (is_busy(2*k) ? 0 : m);
+	}
+
+	// Прямой проход: in[x] - маска портов ввода, из которых достижим узел x.
+	// Неназначенный порт ввода может смотреть в любой свободный узел,
+	// неназначенный выход оператора k - в любой свободный узел за оператором k.
+	std::fill(in.begin(), in.end(), 0);
+	u_int64_t pending = 0;
+	for(uint i = 0; i < p; ++i)
+	if(assigned(q + i))
+	in[e[q + i]] |= u_int64_t(1) << i;
+	else
+	pending |= u_int64_t(1) << i;
+
+	for(uint k = 0; k < q / 2; ++k)
+	{
+		for(uint x = 2*k; x < 2*k + 2; ++x)
+		if(!is_busy(x)) in[x] |= pending;
+
+		const u_int64_t m = in[2*k] | in[2*k + 1];
+		if(m == 0) return false;
+
+		for(uint s = 2*k; s < 2*k + 2; ++s)
+		if(assigned(s))
+		in[e[s]] |= m;
+		else
+		pending |= m;
+	}
+
+	for(uint j = 0; j < p; ++j)
+	reach[j] = in[q + j] | (is_busy(q + j) ? 0 : pending);
+
+	return _g.sift_reach(reach);
+}
+
+bool enumerator::canonical()
+{
+	for(auto &perm : perms)
+	{
+		//! Перенумерация узлов операторов, порты не меняются
+		auto node = [&](uint x) { return x < q ? 2*perm[x / 2] + x % 2 : x; };
+
+		for(uint s = 0; s < n; ++s)
+		relabeled[node(s)] = node(e[s]);
+
+		bool valid = true;
+		for(uint s = 0; s < q && valid; ++s)
+		valid = relabeled[s] >= (s / 2) * 2 + 2;
+
+		if(valid && std::lexicographical_compare(relabeled.begin(), relabeled.end(), e.begin(), e.end()))
+		return false;
+	}
+
+	return true;
+}
+
+std::vector<std::vector<uint> > make_symmetries(uint _bs, uint _dc, uint _w)
+{
+	std::vector<std::vector<uint> > answer;
+
+	std::vector<uint> perm(_bs + _dc + _w);
+	for(uint k = 0; k < perm.size(); ++k)
+	perm[k] = k;
+
+	// Перебор прямого произведения перестановок трёх групп "по одометру":
+	// следующая перестановка младшей группы, при её возврате к началу - следующей группы
+	const uint bounds[4] = {0, _bs, _bs + _dc, _bs + _dc + _w};
+	while(true)
+	{
+		uint g = 0;
+		while(g < 3 && !std::next_permutation(perm.begin() + bounds[g], perm.begin() + bounds[g + 1]))
+		++g;
+
+		if(g == 3) break;
+		answer.push_back(perm);
+	}
+
+	return answer;
+}
+
+uint fact(const uint _top, const uint _bot/* = 1*/)
+{
+    if(_top == _bot)
+    return 1;
+    else return _top * fact(_top - 1, _bot);
+}
+
+void make_templates_graphs(
+    uint _i,
+    uint _p, 
+    std::vector<std::pair<uint, bool> > _g, 
+    std::vector<std::vector<uint> > &answer)
+{
+    const size_t &s = _g.size();
+	if (_i < _p)
+	{
+		for (uint to = 0; to < _g.size(); to++)//Номер узла, куда смотрит порт ввода
+		{
+			if (!_g[to].second)
+			{
+				_g[s - _p + _i].first = to;
+				_g[to].second = true;
+				make_templates_graphs(_i + 1, _p, _g, answer);
+				_g[to].second = false;
+			}
+		}
+	}
+    else 
+    {
+        answer.push_back(std::vector<uint>(_g.size(), 0));
+        for(size_t i = 0; i < _g.size(); ++i)
+        answer.back()[i] = _g[i].first;
+    }
+}
+
+uint make_templates(uint _p, uint _q, size_t _min, std::vector<std::vector<uint> > &_templates)
+{
+	uint startPort = _p + 1; //!< Порт ввода
+	uint T; //!< Число заготовок
+	do
+	{
+		--startPort;
+		T = fact(_p + _q, _q + startPort);
+	} while(T < _min && startPort != 0);
+
+	_templates.clear();
+	_templates.reserve(T);
+	std::vector<std::pair<uint, bool> > g(_p + _q, std::pair<uint, bool>(0, false));
+	make_templates_graphs(startPort, _p, g, _templates);
+
+	return startPort;
+}
+
+#endif //! ENUMERATOR_CPP
@@ -0,0 +1,180 @@
+#ifndef ENUMERATOR_HPP
+#define ENUMERATOR_HPP
+
+#include <vector>
+#include <functional>
+#include <stdlib.h>
+
+#include "graph.hpp"
+
+/*
+ * @brief Нерекурсивный перебор достраиваний заготовок графов.
+ *  Занятость узлов хранится битовой маской (узлов не больше 64), рёбра
+ *  назначаются на месте в одном массиве, а стек перебора - это массив
+ *  следующих кандидатов для каждого исходящего узла. После конструктора
+ *  перебор не выделяет памяти, кроме как внутри graph::set_edges().
+ *
+ *  Объект рассчитан на один поток: счётчики - обычные поля без атомиков.
+ */
+class enumerator {
+public:
+
+	//! Вызывается для каждого графа, прошедшего просеивание
+	typedef std::function<void(const std::vector<uint> &)> visit_t;
+
+	//! Поддерево перебора: назначены рёбра e[0..depth) и порты ввода заготовки
+	struct subtree_t
+	{
+		std::vector<uint> e;
+		uint depth;
+	};
+
+	/*
+	 * @param p     число портов ввода-вывода
+	 * @param bs    число светоделительных пластинок
+	 * @param dc    число направленных светоделителей
+	 * @param w     число волновых пластинок (фазовращателей)
+	 */
+	enumerator(uint ports, uint beamsplitters, uint directCouplers, uint waveplates);
+
+	/*
+	 * @brief Задаёт перестановки однотипных операторов (см. make_symmetries()).
+	 *  Если не пусто - выводятся только канонические представители орбит.
+	 */
+	void set_symmetries(const std::vector<std::vector<uint> > &_perms);
+
+	/*
+	 * @brief Перебирает все достраивания заготовки
+	 *
+	 * @param _templ    Заготовка: порты ввода начиная с _sP уже назначены
+	 * @param _sP       Первый назначенный в заготовке порт ввода
+	 * @param _g        Граф для просеивания (его движок задаётся снаружи)
+	 * @param _sM       Матрица для просеивания
+	 * @param _visit    Обработчик просеянных графов
+	 */
+	void run(
+		const std::vector<uint> &_templ,
+		uint _sP,
+		graph &_g,
+		const graph::smatrix_t &_sM,
+		const visit_t &_visit);
+
+	//! То же для поддерева, начиная с ребра _s.depth
+	void run(
+		const subtree_t &_s,
+		uint _sP,
+		graph &_g,
+		const graph::smatrix_t &_sM,
+		const visit_t &_visit);
+
+	/*
+	 * @brief Дробит поддерево по ребру _s.depth: дописывает в _children
+	 *  все его дочерние поддеревья, не отсечённые проверкой reachable().
+	 *  Вместе дочерние поддеревья дают те же графы, что и run() для _s.
+	 *
+	 * @return false, если в _s назначены все рёбра и дробить нечего
+	 */
+	bool split(
+		const subtree_t &_s,
+		uint _sP,
+		graph &_g,
+		std::vector<subtree_t> &_children);
+
+	u_int64_t visited;		//!< Назначенных рёбер (узлов дерева перебора)
+	u_int64_t leaves;		//!< Полностью построенных графов
+	u_int64_t pruned;		//!< Отсечённых поддеревьев
+	u_int64_t symmetric;	//!< Просеянных, но не канонических графов
+	u_int64_t sifted;		//!< Выведенных графов
+
+protected:
+
+	uint p;		//!< Число портов ввода-вывода
+	uint q;		//!< Число узлов однокубитовых операторов
+	uint n;		//!< Число узлов графа
+
+	uint sP;	//!< Первый назначенный в заготовке порт ввода
+
+	//! Достраиваемый граф
+	std::vector<uint> e;
+
+	//! Следующий кандидат для каждого исходящего узла (стек перебора)
+	std::vector<uint> cand;
+
+	//! Занятые узлы: бит x установлен, если в узел x уже смотрит ребро
+	u_int64_t busy;
+
+	std::vector<std::vector<uint> > perms;
+
+	//! Рабочие массивы reachable() и canonical()
+	std::vector<u_int64_t> out, free_out, in, reach;
+	std::vector<uint> relabeled;
+
+	/*
+	 * @brief Оптимистичная проверка достижимости для частично построенного графа.
+	 *  Каждое ещё не назначенное ребро считается смотрящим сразу во все свободные узлы,
+	 *  куда ему разрешено смотреть. Если даже при этом какой-то оператор недостижим
+	 *  из портов ввода или не достигает портов вывода, либо не проходит
+	 *  graph::sift_reach(), то ни одно достраивание графа не пройдёт просеивание.
+	 *  Маски пересчитываются за O(q+p) при каждом назначении ребра.
+	 *
+	 * @param me    Первый ещё не назначенный исходящий узел (все до него назначены)
+	 * @param _g    Граф, по матрице трансляции которого выполняется просеивание
+	 *
+	 * @return false, если поддерево можно отсечь
+	 */
+	bool reachable(uint me, graph &_g);
+
+	/*
+	 * @brief Проверяет, что граф e - канонический представитель своей орбиты
+	 *  относительно перенумерации однотипных операторов: ни одна перестановка
+	 *  из perms, дающая граф с выходами операторов, смотрящими вперёд,
+	 *  не даёт лексикографически меньшего массива рёбер.
+	 */
+	bool canonical();
+
+	//! Загружает поддерево в e и busy
+	void load(const std::vector<uint> &_e, uint _depth, uint _sP);
+};
+
+/*
+ * @brief Все нетривиальные перестановки операторов одного типа.
+ *  Операторы в графе упорядочены как bs, затем dc, затем w; перестановка
+ *  переводит номер оператора k в perm[k] и не смешивает типы.
+ *
+ * @return Перестановки без тождественной
+ */
+std::vector<std::vector<uint> > make_symmetries(uint _bs, uint _dc, uint _w);
+
+//! Находит факториал _top!. Если указан _bot, то вычисляется факториал _top!/_bot!.
+uint fact(const uint _top, const uint _bot = 1);
+
+/*
+ * @brief Генерация заготовок графов
+ *  Функция рекусивно создаёт заготовки графов, перебирая все комбинации того,
+ *  куда смотрят последние (_i - _p) портов ввода.
+ * 
+ * @param _i        Порт ввода с которого начинаем перебор
+ * @param _p        Число портов ввода
+ * @param _g        Пустой граф (все узлы "0") с отметкой о занятости входного узла
+ * @param answer    Сюда пишется результат
+ */
+void make_templates_graphs(
+    uint _i,
+    uint _p, 
+    std::vector<std::pair<uint, bool> > _g, 
+    std::vector<std::vector<uint> > &answer);
+
+/*
+ * @brief Создаёт заготовки графов, назначая последние порты ввода так,
+ *  чтобы заготовок было не меньше _min (или назначены все порты ввода).
+ *
+ * @param _p        Число портов ввода-вывода
+ * @param _q        Число узлов однокубитовых операторов, 2*(bs+dc+w)
+ * @param _min      Желаемое минимальное число заготовок
+ * @param _templates    Сюда пишутся заготовки
+ *
+ * @return Первый назначенный в заготовках порт ввода (startPort)
+ */
+uint make_templates(uint _p, uint _q, size_t _min, std::vector<std::vector<uint> > &_templates);
+
+#endif //! ENUMERATOR_HPP
@@ -1,11 +1,23 @@
 #ifndef GRAPH_CPP
 #define GRAPH_CPP
 
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+
 #include "graph.hpp"
+#include "simd.hpp"
+#include "static_graph.hpp"
+#include "trace.hpp"
+
+//! Предел перебора перенумераций в structure_key(); дальше ключ строится без перебора
+#define STRUCTURE_PERMUTATIONS_MAX	720
 
 graph::graph(uint ports, uint beamsplitters, uint directCouplers, uint waveplates)
 {
 	p = ports;
+	engine = pathEnumeration;
+	fixedStale = false;
 	bs = beamsplitters;
 	dc = directCouplers;
 	w = waveplates;
@@ -21,9 +33,28 @@ graph::graph(uint ports, uint beamsplitters, uint directCouplers, uint waveplate
 
 	var.resize(bs + dc + 2 * w, 0.5);
 
+	var_offset.resize(comb.size());
+	for(uint i = 0, v = 0; i < comb.size(); ++i)
+	{
+		var_offset[i] = v;
+		v += (comb[i] == waveplate) ? 2 : 1;
+	}
+
+	func.resize(4 * comb.size());
+	func_adj.resize(4 * comb.size());
+	update_func();
+
 	targetMatrix.resize(p, std::vector<std::complex<double> >(p, 0.0));
 
-	traj.resize(p, std::vector<std::set<std::vector<uint> > >(p));
+	traj.resize(p, std::vector<std::vector<span_t> >(p));
+
+	ampl.resize(p*p);
+	ampl_adj.resize(p*p);
+	reach.resize(p, 0);
+	wave.resize(q + p);
+	wave_adj.resize(q + p);
+	prog.cell.assign(p*p + 1, 0);
+	prog.path.assign(1, 0);
 
 	translate.resize(4, std::vector<std::vector<uint> >(4, std::vector<uint>(4)));
 
@@ -73,13 +104,49 @@ const std::string graph::print(void)
 
 void graph::set_edges(const std::vector<uint> &_edges)
 {
+	TRACE_SCOPE_GRAPH("set_edges");
 	edges = _edges;
-	make_matrix_traj();
+
+	if(engine == transferMatrix || engine == staticKernel)
+	{
+		make_order();
+
+		// Шаблон строится только при вычислении отклонения: сифтеру он не нужен
+		if(engine == staticKernel)
+		fixedStale = true;
+	}
+	else
+	{
+		make_matrix_traj();
+
+		if(engine == symbolicTape)
+		compile_tape();
+	}
+}
+
+void graph::set_engine(engines_types _engine)
+{
+	engine = _engine;
+
+	if(!edges.empty())
+	set_edges(edges);
+}
+
+graph::engines_types graph::get_engine()
+{
+	return engine;
 }
 
 void graph::set_variables(const std::vector<double> &_var)
 {
 	var= _var;
+	update_func();
+}
+
+void graph::update_func()
+{
+	for(uint i = 0; i < comb.size(); ++i)
+	make_func(comb[i], var_num(i), &func[i << 2]);
 }
 
 std::vector<double> graph::get_variables()
@@ -94,208 +161,853 @@ std::vector<uint> graph::get_edges()
 
 double graph::get_deviation()
 {
+	// Ячейки translate и отклонение за один проход шаблона static_graph
+	if(engine == staticKernel)
+	{
+		if(fixedStale) make_static();
+		if(fixed) return fixed->deviation(func.data());
+	}
+
 	double deviation = 0.;
 
-	cmatrix_t MTruth = get_matrix_truth();
+	eval_amplitude(false);
 
-	for(size_t i = 0; i < p; ++i)
-	for(size_t j = 0; j < p; ++j)
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t i = 0; i < t; ++i)
+	for(size_t j = 0; j < t; ++j)
 	{
 		deviation += abs(
-			MTruth[i][j] - targetMatrix[i][j]
+			truth_cell(i, j) - targetMatrix[i][j]
 		);
 	}
 
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	if(i >= t || j >= t)
+	deviation += abs(targetMatrix[i][j]);
+
 	return deviation;
 }
 
-graph::cmatrix_t graph::get_matrix_amplitude()
+double graph::get_deviation(std::vector<double> &_grad)
 {
-	cmatrix_t ret(p, std::vector<std::complex<double> >(p));
+	double deviation = 0.;
+
+	eval_amplitude(false);
+
+	// Для вещественной f и комплексной z сопряжённая переменная zbar определена так,
+	// что df = Re(conj(zbar) * dz). Для y = a*b: abar += ybar * conj(b).
+	std::fill(ampl_adj.begin(), ampl_adj.end(), 0.);
+
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t i = 0; i < t; ++i)
+	for(size_t j = 0; j < t; ++j)
+	{
+		const std::vector<uint> &a = translate[i][j];
+		const uint A = a[0]*p + a[1], B = a[2]*p + a[3];
+		const uint C = a[0]*p + a[3], D = a[2]*p + a[1];
+
+		const std::complex<double> z = truth_cell(i, j) - targetMatrix[i][j];
+		const double r = abs(z);
+		deviation += r;
+
+		if(r == 0.) continue;
+
+		const std::complex<double> g = z / r;
+		ampl_adj[A] += g * conj(ampl[B]);
+		ampl_adj[B] += g * conj(ampl[A]);
+		ampl_adj[C] += g * conj(ampl[D]);
+		ampl_adj[D] += g * conj(ampl[C]);
+	}
 
 	for(size_t i = 0; i < p; ++i)
 	for(size_t j = 0; j < p; ++j)
+	if(i >= t || j >= t)
+	deviation += abs(targetMatrix[i][j]);
+
+	std::fill(func_adj.begin(), func_adj.end(), 0.);
+
+	if(engine == transferMatrix || engine == staticKernel)
+	adjoint_transfer();
+	else if(engine == symbolicTape)
+	adjoint_tape();
+	else
+	adjoint_program();
+
+	adjoint_func(_grad);
+
+	return deviation;
+}
+
+void graph::get_deviation(const double *_x, size_t _n, double *_dev, batch_t &_ws) const
+{
+	const simd_kernels_t &k = simd_kernels();
+
+	// Таблицы func всех наборов. Корни светоделителей с v из [0, 1] считаются
+	// векторно, тригонометрия волновых пластинок и остальные случаи - через make_func()
+	_ws.func_re.resize(func.size() * _n);
+	_ws.func_im.resize(func.size() * _n);
+	_ws.root_a.resize(_n);
+	_ws.root_b.resize(_n);
+	for(uint i = 0; i < comb.size(); ++i)
 	{
-		std::set<std::vector<uint> > t = traj[i][j];
-		
-		if(!t.empty())
-		for(auto it = t.begin(); it != t.end(); ++it)
-		ret[i][j] += traj_to_ampl(*it);
+		const double *v = _x + var_offset[i]*_n;
+		double *ur = _ws.func_re.data() + 4*i*_n, *ui = _ws.func_im.data() + 4*i*_n;
+
+		if(comb[i] != waveplate && std::all_of(v, v + _n, [](double _v) { return _v >= 0 && _v <= 1; }))
+		{
+			const double *a = _ws.root_a.data(), *b = _ws.root_b.data();
+			k.oper_sqrt(v, _n, _ws.root_a.data(), _ws.root_b.data());
+
+			//! Для направленного светоделителя sqrt(1 - v) умножается на exp(i*pi/2)
+			const std::complex<double> e = (comb[i] == beamsplitter) ? 1. : exp(std::complex<double>(0, M_PI / 2));
+			const double sign = (comb[i] == beamsplitter) ? -1. : 1.;
+			for(size_t s = 0; s < _n; ++s)
+			{
+				ur[s] = a[s];
+				ui[s] = 0.;
+				ur[_n + s] = ur[2*_n + s] = b[s]*e.real();
+				ui[_n + s] = ui[2*_n + s] = b[s]*e.imag();
+				ur[3*_n + s] = sign*a[s];
+				ui[3*_n + s] = sign*0.;
+			}
+			continue;
+		}
+
+		for(size_t s = 0; s < _n; ++s)
+		{
+			double w[2];
+			w[0] = v[s];
+			w[1] = (comb[i] == waveplate) ? v[_n + s] : 0;
+
+			std::complex<double> u[4];
+			make_func(comb[i], w, u);
+
+			for(uint c = 0; c < 4; ++c)
+			{
+				ur[c*_n + s] = u[c].real();
+				ui[c*_n + s] = u[c].imag();
+			}
+		}
 	}
 
-	return ret;
+	_ws.ampl_re.resize(p*p*_n);
+	_ws.ampl_im.resize(p*p*_n);
+	const double *ar = _ws.ampl_re.data(), *ai = _ws.ampl_im.data();
+
+	// Те же проходы, что eval_transfer(), eval_tape() и eval_program(), но каждый шаг - сразу для всех наборов
+	if(engine == transferMatrix || engine == staticKernel)
+	{
+		_ws.wave_re.resize((q + p)*_n);
+		_ws.wave_im.resize((q + p)*_n);
+
+		k.transfer(
+			p, q, edges.data(), order.data(), order.size(),
+			_ws.func_re.data(), _ws.func_im.data(), _n,
+			_ws.wave_re.data(), _ws.wave_im.data(), _ws.ampl_re.data(), _ws.ampl_im.data());
+	}
+	else if(engine == symbolicTape)
+	{
+		const size_t regs = 1 + tape.leaf.size() + tape.used;
+		_ws.tape_re.resize(regs*_n);
+		_ws.tape_im.resize(regs*_n);
+
+		k.tape(
+			tape.leaf.size(), tape.leaf.data(),
+			tape.used, tape.kind.data(), tape.a.data(), tape.b.data(),
+			_ws.func_re.data(), _ws.func_im.data(), _n,
+			_ws.tape_re.data(), _ws.tape_im.data());
+
+		// Ячейки вне translate в отклонение не входят
+		for(size_t c = 0; c < p*p; ++c)
+		{
+			const int r = tape.cell[c];
+			double *cr = _ws.ampl_re.data() + c*_n, *ci = _ws.ampl_im.data() + c*_n;
+			if(r < 0 || size_t(r) >= regs)
+			{
+				std::fill(cr, cr + _n, 0.);
+				std::fill(ci, ci + _n, 0.);
+				continue;
+			}
+
+			std::copy(_ws.tape_re.begin() + r*_n, _ws.tape_re.begin() + (r + 1)*_n, cr);
+			std::copy(_ws.tape_im.begin() + r*_n, _ws.tape_im.begin() + (r + 1)*_n, ci);
+		}
+	}
+	else
+	{
+		_ws.prod_re.resize(_n);
+		_ws.prod_im.resize(_n);
+
+		k.path_sum(
+			p*p, prog.cell.data(), prog.path.data(), prog.hop.data(),
+			_ws.func_re.data(), _ws.func_im.data(), _n,
+			_ws.ampl_re.data(), _ws.ampl_im.data(), _ws.prod_re.data(), _ws.prod_im.data());
+	}
+
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t s = 0; s < _n; ++s)
+	{
+		auto A = [&](uint r, uint c) { return std::complex<double>(ar[(r*p + c)*_n + s], ai[(r*p + c)*_n + s]); };
+
+		double deviation = 0.;
+		for(size_t i = 0; i < t; ++i)
+		for(size_t j = 0; j < t; ++j)
+		{
+			const std::vector<uint> &m = translate[i][j];
+			deviation += abs(
+				A(m[0], m[1]) * A(m[2], m[3]) + A(m[0], m[3]) * A(m[2], m[1]) - targetMatrix[i][j]
+			);
+		}
+
+		for(size_t i = 0; i < p; ++i)
+		for(size_t j = 0; j < p; ++j)
+		if(i >= t || j >= t)
+		deviation += abs(targetMatrix[i][j]);
+
+		_dev[s] = deviation;
+	}
 }
 
-graph::cmatrix_t graph::get_matrix_truth()
+void graph::adjoint_program()
 {
-	cmatrix_t ret(p, std::vector<std::complex<double> >(p));
+	const uint *cell = prog.cell.data();
+	const uint *path = prog.path.data();
+	const uint *hop = prog.hop.data();
+	const std::complex<double> *f = func.data();
 
-	for(size_t i = 0; i < p; ++i)
-	for(size_t j = 0; j < p; ++j)
+	for(size_t c = 0; c < p*p; ++c)
 	{
-		// Ячейка трансляционной матрицы
-		std::vector<uint> a = translate[i][j];
+		if(ampl_adj[c] == 0.) continue;
 
-		//! T[i][j] = A*B + C*D
-		std::complex<double> A, B, C, D;
-		
+		for(uint t = cell[c]; t < cell[c + 1]; ++t)
 		{
-			std::set<std::vector<uint> > t = traj[a[0]][a[1]];
-			if(!t.empty())
-			for(auto it = t.begin(); it != t.end(); ++it)
-			A += traj_to_ampl(*it);
+			const uint n = path[t + 1] - path[t];
+			const uint *h = hop + path[t];
+
+			if(prefix.size() < n + 1)
+			prefix.resize(n + 1);
+
+			// prefix[k] - произведение первых k множителей траектории
+			prefix[0] = 1.;
+			for(uint k = 0; k < n; ++k)
+			prefix[k + 1] = prefix[k] * f[h[k]];
+
+			// Произведение всех множителей, кроме k-го, = prefix[k] * suffix
+			std::complex<double> suffix = 1.;
+			for(uint k = n; k-- > 0;)
+			{
+				func_adj[h[k]] += ampl_adj[c] * conj(prefix[k] * suffix);
+				suffix *= f[h[k]];
+			}
 		}
+	}
+}
+
+void graph::adjoint_transfer()
+{
+	const std::complex<double> *f = func.data();
+	std::complex<double> *a = wave.data();
+	std::complex<double> *b = wave_adj.data();
+
+	for(uint i = 0; i < p; ++i)
+	{
+		// Прямой проход: на каждом узле остаётся его итоговая амплитуда,
+		// поскольку в любой узел смотрит ровно одно ребро
+		std::fill(wave.begin(), wave.end(), 0.);
+		a[edges[q + i]] = 1.;
+
+		for(auto k : order)
+		{
+			const std::complex<double> a0 = a[2*k], a1 = a[2*k + 1];
+			const std::complex<double> *u = f + 4*k;
+
+			a[edges[2*k]]     += a0*u[0] + a1*u[2];
+			a[edges[2*k + 1]] += a0*u[1] + a1*u[3];
+		}
+
+		// Обратный проход
+		std::fill(wave_adj.begin(), wave_adj.end(), 0.);
+		for(uint j = 0; j < p; ++j)
+		b[q + j] = ampl_adj[i*p + j];
+
+		for(auto it = order.rbegin(); it != order.rend(); ++it)
 		{
-			std::set<std::vector<uint> > &t = traj[a[2]][a[3]];
-			if(!t.empty())
-			for(auto it = t.begin(); it != t.end(); ++it)
-			B += traj_to_ampl(*it);
+			const uint k = *it;
+			const std::complex<double> a0 = a[2*k], a1 = a[2*k + 1];
+			const std::complex<double> b0 = b[edges[2*k]], b1 = b[edges[2*k + 1]];
+			const std::complex<double> *u = f + 4*k;
+			std::complex<double> *ub = func_adj.data() + 4*k;
+
+			ub[0] += b0 * conj(a0);
+			ub[1] += b1 * conj(a0);
+			ub[2] += b0 * conj(a1);
+			ub[3] += b1 * conj(a1);
+
+			b[2*k]     = b0 * conj(u[0]) + b1 * conj(u[1]);
+			b[2*k + 1] = b0 * conj(u[2]) + b1 * conj(u[3]);
 		}
+	}
+}
+
+void graph::adjoint_func(std::vector<double> &_grad)
+{
+	using namespace std;
+
+	//! Ограничение снизу для sqrt(t) в производной 1/(2*sqrt(t)) на границах t = 0 и t = 1
+	const double SQRT_EPS = 1e-12;
 
+	_grad.assign(var.size(), 0.);
+
+	for(uint k = 0; k < comb.size(); ++k)
+	{
+		const complex<double> *ub = func_adj.data() + 4*k;
+		const uint v = var_offset[k];
+
+		//! Производные элементов матрицы оператора по переменной
+		complex<double> d[4];
+
+		switch (comb[k])
 		{
-			std::set<std::vector<uint> > &t = traj[a[0]][a[3]];
-			if(!t.empty())
-			for(auto it = t.begin(); it != t.end(); ++it)
-			C += traj_to_ampl(*it);
+		case beamsplitter:
+		case directCoupler:
+		{
+			const double s0 = max(sqrt(var[v]), SQRT_EPS);
+			const double s1 = max(sqrt(1 - var[v]), SQRT_EPS);
+			const complex<double> ph = (comb[k] == beamsplitter) ? 
+				complex<double>(1) : exp(complex<double>(0, M_PI / 2));
+
+			d[0] = 0.5 / s0;
+			d[1] = d[2] = -0.5 / s1 * ph;
+			d[3] = (comb[k] == beamsplitter) ? -0.5 / s0 : 0.5 / s0;
+
+			for(uint c = 0; c < 4; ++c)
+			_grad[v] += real(conj(ub[c]) * d[c]);
+			break;
 		}
+		case waveplate:
 		{
-			std::set<std::vector<uint> > &t = traj[a[2]][a[1]];
-			if(!t.empty())
-			for(auto it = t.begin(); it != t.end(); ++it)
-			D += traj_to_ampl(*it);
+			const complex<double> e = exp(complex<double>(0, var[v] * 2 * M_PI));
+			const double c = cos(var[v + 1] * 2 * M_PI);
+			const double s = sin(var[v + 1] * 2 * M_PI);
+			const complex<double> de = complex<double>(0, 2 * M_PI) * e;
+
+			// По фазе phi
+			d[0] = de * c * c;
+			d[1] = d[2] = de * c * s;
+			d[3] = de * s * s;
+			for(uint i = 0; i < 4; ++i)
+			_grad[v] += real(conj(ub[i]) * d[i]);
+
+			// По углу alpha
+			d[0] = 4 * M_PI * c * s * (complex<double>(1) - e);
+			d[1] = d[2] = 2 * M_PI * (c * c - s * s) * (e - complex<double>(1));
+			d[3] = 4 * M_PI * c * s * (e - complex<double>(1));
+			for(uint i = 0; i < 4; ++i)
+			_grad[v + 1] += real(conj(ub[i]) * d[i]);
+			break;
+		}
+		default:;
 		}
-		
-		ret[i][j] = A*B + C*D;
 	}
+}
+
+graph::cmatrix_t graph::get_matrix_amplitude()
+{
+	cmatrix_t ret(p, std::vector<std::complex<double> >(p));
+
+	eval_amplitude();
+
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	ret[i][j] = ampl[i*p + j];
 
 	return ret;
 }
 
+graph::cmatrix_t graph::get_matrix_truth()
+{
+	cmatrix_t ret(p, std::vector<std::complex<double> >(p));
+
+	eval_amplitude();
+
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t i = 0; i < t; ++i)
+	for(size_t j = 0; j < t; ++j)
+	ret[i][j] = truth_cell(i, j);
+
+	return ret;
+}
+
+std::complex<double> graph::truth_cell(uint i, uint j)
+{
+	// Ячейка трансляционной матрицы
+	const std::vector<uint> &a = translate[i][j];
+
+	//! T[i][j] = A*B + C*D
+	return 
+		ampl[a[0]*p + a[1]] * ampl[a[2]*p + a[3]] + 
+		ampl[a[0]*p + a[3]] * ampl[a[2]*p + a[1]];
+}
+
 void graph::set_target_matrix(const cmatrix_t &_tM)
 {
 	targetMatrix = _tM;
+
+	if(engine == staticKernel && !edges.empty())
+	fixedStale = true;
 }
 
 void graph::make_matrix_traj()
 {
+	fill_traj();
+	compile_program();
+}
+
+void graph::fill_traj()
+{
+	// clear() сохраняет ёмкость: после первых графов память больше не выделяется
+	traj_arena.clear();
 	for(size_t i = 0; i < p; ++i)
 	for(size_t j = 0; j < p; ++j)
 	traj[i][j].clear();
 
 	for(size_t i = edges.size() - p; i < edges.size(); ++i)
-	paths(i, traj);
+	{
+		way.clear();
+		paths(i);
+	}
+
+	// Порядок траекторий в ячейке тот же, что давал std::set<std::vector<uint> >,
+	// поэтому суммы в eval_program() складываются в прежнем порядке
+	const uint *a = traj_arena.data();
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	std::sort(traj[i][j].begin(), traj[i][j].end(), [a](const span_t &_x, const span_t &_y) {
+		return std::lexicographical_compare(a + _x.offset, a + _x.offset + _x.len, a + _y.offset, a + _y.offset + _y.len);
+	});
+}
+
+void graph::compile_program()
+{
+	prog.cell.assign(1, 0);
+	prog.path.assign(1, 0);
+	prog.hop.clear();
+
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	{
+		for(auto &span : traj[i][j])
+		{
+			const uint *t = traj_arena.data() + span.offset;
+
+			// Пара (вход оператора, выход оператора) упаковывается в один код:
+			// t[k] = 2*оператор + вход, младший бит t[k+1] - выход
+			for(size_t k = 1; k < span.len - 1; k += 2)
+			prog.hop.push_back(2*t[k] + t[k+1] % 2);
+
+			prog.path.push_back(prog.hop.size());
+		}
+
+		prog.cell.push_back(prog.path.size() - 1);
+	}
 }
 
-void graph::paths(uint start, traj_t &matrix, std::vector<uint> way)
+void graph::eval_program()
+{
+	const uint *cell = prog.cell.data();
+	const uint *path = prog.path.data();
+	const uint *hop = prog.hop.data();
+	const std::complex<double> *f = func.data();
+
+	for(size_t c = 0; c < p*p; ++c)
+	{
+		std::complex<double> sum = 0.;
+
+		for(uint t = cell[c]; t < cell[c + 1]; ++t)
+		{
+			std::complex<double> prod = 1.0;
+
+			for(uint h = path[t]; h < path[t + 1]; ++h)
+			prod *= f[hop[h]];
+
+			sum += prod;
+		}
+
+		ampl[c] = sum;
+	}
+}
+
+void graph::compile_tape()
+{
+	make_order();
+
+	//! Место оператора в топологическом порядке. Множители одночлена сортируются
+	//! по нему, то есть идут по ходу траектории, и общие начала траекторий совпадают.
+	std::vector<uint> rank(comb.size());
+	for(uint k = 0; k < order.size(); ++k)
+	rank[order[k]] = k;
+
+	auto before = [&](uint _x, uint _y) {
+		return rank[_x >> 2] != rank[_y >> 2] ? rank[_x >> 2] < rank[_y >> 2] : _x < _y;
+	};
+
+	tape.leaf.clear();
+	tape.kind.clear();
+	tape.a.clear();
+	tape.b.clear();
+	tape.cell.assign(p*p, -1);
+	tape.used = 0;
+
+	//! Регистр листа по коду перехода
+	std::vector<uint> leafOf(func.size(), 0);
+	for(auto h : prog.hop)
+	leafOf[fold_code(h)] = 1;
+
+	for(uint h = 0; h < func.size(); ++h)
+	if(leafOf[h])
+	{
+		tape.leaf.push_back(h);
+		leafOf[h] = tape.leaf.size();
+	}
+
+	const uint base = 1 + tape.leaf.size();
+
+	//! Построенные команды: (a, b, вид) -> регистр
+	std::unordered_map<u_int64_t, uint> made;
+	auto emit = [&](uint _kind, uint _a, uint _b) -> uint
+	{
+		// Обе операции коммутативны
+		if(_a > _b) std::swap(_a, _b);
+
+		const u_int64_t key = (u_int64_t(_a) << 33) | (u_int64_t(_b) << 1) | _kind;
+		auto it = made.find(key);
+		if(it != made.end()) return it->second;
+
+		tape.kind.push_back(_kind);
+		tape.a.push_back(_a);
+		tape.b.push_back(_b);
+
+		const uint r = base + tape.kind.size() - 1;
+		made.emplace(key, r);
+		return r;
+	};
+
+	//! Сначала ячейки из translate, затем остальные
+	std::vector<uint> cells = used_cells();
+	const size_t used = cells.size();
+	for(uint c = 0; c < p*p; ++c)
+	if(!std::binary_search(cells.begin(), cells.begin() + used, c))
+	cells.push_back(c);
+
+	std::vector<uint> mono;
+	for(size_t n = 0; n < cells.size(); ++n)
+	{
+		const uint c = cells[n];
+
+		int sum = -1;
+		for(uint t = prog.cell[c]; t < prog.cell[c + 1]; ++t)
+		{
+			mono.clear();
+			for(uint h = prog.path[t]; h < prog.path[t + 1]; ++h)
+			mono.push_back(fold_code(prog.hop[h]));
+			std::sort(mono.begin(), mono.end(), before);
+
+			uint r = 0;
+			for(size_t k = 0; k < mono.size(); ++k)
+			r = (k == 0) ? leafOf[mono[k]] : emit(0, r, leafOf[mono[k]]);
+
+			sum = (sum < 0) ? int(r) : int(emit(1, sum, r));
+		}
+
+		tape.cell[c] = sum;
+
+		if(n + 1 == used)
+		tape.used = tape.kind.size();
+	}
+}
+
+void graph::make_static()
+{
+	std::vector<std::complex<double> > tM(p*p);
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	tM[i*p + j] = targetMatrix[i][j];
+
+	// Для операторов вне порядка (циклы) шаблон неприменим
+	fixed.reset(order.size() == comb.size() ?
+		make_static_graph(p, comb.size(), edges.data(), order.data(), tM.data()) : NULL);
+	fixedStale = false;
+}
+
+void graph::eval_tape(bool _all)
+{
+	const size_t base = 1 + tape.leaf.size();
+	const size_t ops = _all ? tape.kind.size() : tape.used;
+
+	tape_val.resize(base + tape.kind.size());
+	std::complex<double> *r = tape_val.data();
+
+	r[0] = 1.;
+	for(size_t l = 0; l < tape.leaf.size(); ++l)
+	r[1 + l] = func[tape.leaf[l]];
+
+	for(size_t k = 0; k < ops; ++k)
+	r[base + k] = tape.kind[k] ? r[tape.a[k]] + r[tape.b[k]] : r[tape.a[k]] * r[tape.b[k]];
+
+	for(size_t c = 0; c < p*p; ++c)
+	{
+		const int i = tape.cell[c];
+		ampl[c] = (i < 0 || size_t(i) >= base + ops) ? 0. : r[i];
+	}
+}
+
+void graph::adjoint_tape()
+{
+	const size_t base = 1 + tape.leaf.size();
+	const std::complex<double> *r = tape_val.data();
+
+	// Сопряжённые ненулевые только у ячеек из translate, их команды - первые tape.used
+	tape_adj.assign(base + tape.used, 0.);
+	std::complex<double> *b = tape_adj.data();
+
+	for(size_t c = 0; c < p*p; ++c)
+	if(tape.cell[c] >= 0 && ampl_adj[c] != 0.)
+	b[tape.cell[c]] += ampl_adj[c];
+
+	for(size_t k = tape.used; k-- > 0;)
+	{
+		const std::complex<double> z = b[base + k];
+		if(z == 0.) continue;
+
+		const uint x = tape.a[k], y = tape.b[k];
+		if(tape.kind[k])
+		{
+			b[x] += z;
+			b[y] += z;
+		}
+		else
+		{
+			b[x] += z * conj(r[y]);
+			b[y] += z * conj(r[x]);
+		}
+	}
+
+	for(size_t l = 0; l < tape.leaf.size(); ++l)
+	func_adj[tape.leaf[l]] += b[1 + l];
+}
+
+std::vector<uint> graph::used_cells() const
+{
+	std::vector<uint> cells;
+
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t i = 0; i < t; ++i)
+	for(size_t j = 0; j < t; ++j)
+	{
+		const std::vector<uint> &a = translate[i][j];
+		cells.push_back(a[0]*p + a[1]);
+		cells.push_back(a[2]*p + a[3]);
+		cells.push_back(a[0]*p + a[3]);
+		cells.push_back(a[2]*p + a[1]);
+	}
+
+	std::sort(cells.begin(), cells.end());
+	cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+	return cells;
+}
+
+uint graph::fold_code(uint _h) const
+{
+	if((_h & 3) == 2) _h ^= 3;
+	if((_h & 3) == 3 && comb[_h >> 2] == directCoupler) _h ^= 3;
+	return _h;
+}
+
+void graph::paths(uint start)
 {
 	way.push_back(start);
 	way.push_back(edges[start]);
 
 	if (edges[start] < edges.size() - p) //Если наш порт смотрит в однокубитовый оператор
 	{
-		paths((edges[start] / 2) * 2, matrix, way);
-		paths((edges[start] / 2) * 2 + 1, matrix, way);
+		paths((edges[start] / 2) * 2);
+		paths((edges[start] / 2) * 2 + 1);
 	}
 	else//Если наш порт смотрит в порт вывода
 	{
-		//Запишем получившуюся траекторию в массив
-		matrix[way.front() - q][way.back() - q].insert(way);
+		//Запишем получившуюся траекторию в арену
+		const span_t span = {uint(traj_arena.size()), uint(way.size())};
+		traj_arena.insert(traj_arena.end(), way.begin(), way.end());
+		traj[way.front() - q][way.back() - q].push_back(span);
 	}
+
+	way.resize(way.size() - 2);
 };
 
 bool graph::sift(const smatrix_t &_sM)
 {
-	if(traj[0][0].empty())
-	make_matrix_traj();
+	TRACE_SCOPE_GRAPH("sift");
+
+	if(engine == pathEnumeration || engine == symbolicTape)
+	{
+		if(traj[0][0].empty())
+		make_matrix_traj();
+
+		for(size_t j = 0; j < p; ++j)
+		{
+			reach[j] = 0;
+			for(size_t i = 0; i < p; ++i)
+			if(!traj[i][j].empty())
+			reach[j] |= u_int64_t(1) << i;
+		}
+	}
+
+	return sift_reach(reach);
+}
 
+bool graph::sift_reach(const std::vector<u_int64_t> &_reach)
+{
 	bool sift_ok = true;
 
-	for(size_t i = 0; i < p; ++i)
-	for(size_t j = 0; j < p; ++j)
+	const size_t t = std::min<size_t>(p, translate.size());
+	for(size_t i = 0; i < t && sift_ok; ++i)
+	for(size_t j = 0; j < t; ++j)
 	{
 		std::vector<uint> &a = translate[i][j];
 		if(
-			(traj[a[0]][a[1]].empty() || traj[a[2]][a[3]].empty()) &&
-			(traj[a[0]][a[3]].empty() || traj[a[2]][a[1]].empty())
+			(!((_reach[a[1]] >> a[0]) & 1) || !((_reach[a[3]] >> a[2]) & 1)) &&
+			(!((_reach[a[3]] >> a[0]) & 1) || !((_reach[a[1]] >> a[2]) & 1))
 		) {sift_ok = false; break;}
 	}
 
 	return sift_ok;
 }
 
+void graph::make_order()
+{
+	const uint n = comb.size();
+
+	//! Число ещё не обработанных операторов, смотрящих в оператор
+	std::vector<uint> deg(n, 0);
+	for(uint me = 0; me < q; ++me)
+	if(edges[me] < q)
+	++deg[edges[me] / 2];
+
+	// Алгоритм Кана. Для графов из сифтера выходы операторов смотрят только вперёд,
+	// поэтому порядок совпадает с нумерацией операторов.
+	order.clear();
+	for(uint k = 0; k < n; ++k)
+	if(deg[k] == 0)
+	order.push_back(k);
+
+	for(size_t i = 0; i < order.size(); ++i)
+	for(uint me = 2*order[i]; me < 2*order[i] + 2; ++me)
+	if(edges[me] < q && --deg[edges[me] / 2] == 0)
+	order.push_back(edges[me] / 2);
+
+	//! Маски портов ввода, из которых достижим узел
+	std::vector<u_int64_t> mask(q + p, 0);
+	for(uint i = 0; i < p; ++i)
+	mask[edges[q + i]] |= u_int64_t(1) << i;
+
+	for(auto k : order)
+	{
+		const u_int64_t m = mask[2*k] | mask[2*k + 1];
+		mask[edges[2*k]] |= m;
+		mask[edges[2*k + 1]] |= m;
+	}
+
+	for(uint j = 0; j < p; ++j)
+	reach[j] = mask[q + j];
+}
+
+void graph::eval_transfer()
+{
+	const std::complex<double> *f = func.data();
+	std::complex<double> *a = wave.data();
+
+	for(uint i = 0; i < p; ++i)
+	{
+		std::fill(wave.begin(), wave.end(), 0.);
+		a[edges[q + i]] = 1.;
+
+		for(auto k : order)
+		{
+			const std::complex<double> a0 = a[2*k], a1 = a[2*k + 1];
+			const std::complex<double> *u = f + 4*k;
+
+			a[edges[2*k]]     += a0*u[0] + a1*u[2];
+			a[edges[2*k + 1]] += a0*u[1] + a1*u[3];
+		}
+
+		for(uint j = 0; j < p; ++j)
+		ampl[i*p + j] = a[q + j];
+	}
+}
+
+void graph::eval_amplitude(bool _all)
+{
+	if(engine == transferMatrix || engine == staticKernel)
+	eval_transfer();
+	else if(engine == symbolicTape)
+	eval_tape(_all);
+	else
+	eval_program();
+}
+
 std::complex<double> graph::get_func(uint oper_num, uint in, uint out)
+{
+	std::complex<double> u[4];
+	make_func(comb[oper_num], var_num(oper_num), u);
+
+	return u[(in << 1) | out];
+}
+
+void graph::make_func(operators_types _type, const double *_v, std::complex<double> *_u)
 {
 	using namespace std;
-	switch (comb[oper_num])
+	switch (_type)
 	{
 	case beamsplitter:
 	{
-		double *tmp = var_num(oper_num);
-		if (in == 0 && out == 0) return sqrt(*tmp); else
-		if (in == 0 && out == 1) return sqrt(complex<double>(1,0) - *tmp); else
-		if (in == 1 && out == 0) return sqrt(complex<double>(1,0) - *tmp); else
-		if (in == 1 && out == 1) return -sqrt(*tmp);
+		_u[0] = sqrt(*_v);
+		_u[1] = sqrt(complex<double>(1,0) - *_v);
+		_u[2] = sqrt(complex<double>(1,0) - *_v);
+		_u[3] = -sqrt(*_v);
 		break;
 	}
 	case directCoupler:
 	{
-		double *tmp = var_num(oper_num);
-
-		if (in == 0 && out == 0) 
-		return 
-			sqrt(*tmp); else
-		if (in == 0 && out == 1) 
-		return 
-			sqrt((complex<double>)1 - *tmp)*exp(complex<double>(0, M_PI / 2)); else
-		if (in == 1 && out == 0) 
-		return
-			sqrt((complex<double>)1 - *tmp)*exp(complex<double>(0, M_PI / 2)); else
-		if (in == 1 && out == 1)
-		return
-			sqrt(*tmp);
+		_u[0] = sqrt(*_v);
+		_u[1] = sqrt((complex<double>)1 - *_v)*exp(complex<double>(0, M_PI / 2));
+		_u[2] = sqrt((complex<double>)1 - *_v)*exp(complex<double>(0, M_PI / 2));
+		_u[3] = sqrt(*_v);
 		break;
 	}
 	case waveplate:
 	{
-		double *phi = var_num(oper_num);
-		double *alpha = (phi + 1);
-
-		if (in == 0 && out == 0) 
-		return 
-			exp(complex<double>(0, *phi * 2 * M_PI)) * 
-			pow(cos(*alpha * 2 * M_PI), 2) + pow(sin(*alpha * 2 * M_PI),2); else
-		if (in == 0 && out == 1) 
-		return 
-			(exp(complex<double>(0,*phi * 2 * M_PI)) - (complex<double>)1) * 
-			cos(*alpha * 2 * M_PI)*sin(*alpha * 2 * M_PI); else
-		if (in == 1 && out == 0)
-		return 
-			(exp(complex<double>(0, *phi * 2 * M_PI)) - (complex<double>)1) * 
-			cos(*alpha * 2 * M_PI)*sin(*alpha * 2 * M_PI); else
-		if (in == 1 && out == 1) 
-		return 
-			exp(complex<double>(0, *phi * 2 * M_PI)) * 
-			pow(sin(*alpha * 2 * M_PI), 2) + pow(cos(*alpha * 2 * M_PI), 2);
+		const double phi = _v[0];
+		const double alpha = _v[1];
+
+		const complex<double> e = exp(complex<double>(0, phi * 2 * M_PI));
+		const double c = cos(alpha * 2 * M_PI);
+		const double s = sin(alpha * 2 * M_PI);
+
+		_u[0] = e * pow(c, 2) + pow(s, 2);
+		_u[1] = (e - (complex<double>)1) * c*s;
+		_u[2] = (e - (complex<double>)1) * c*s;
+		_u[3] = e * pow(s, 2) + pow(c, 2);
 		break;
 	}
-	default: return 0;
+	default: _u[0] = _u[1] = _u[2] = _u[3] = 0;
 	}
 }
 
 double* graph::var_num(uint oper_num)
 {
-	//Вычислим номер необходимого оператора из массива var[]
-	uint var_num = 0;
-
-	for (uint i = 0; i < oper_num; i++)
-		switch (comb[i])
-		{
-		case beamsplitter:
-		case directCoupler: var_num++; break;
-		case waveplate: var_num += 2; break;
-		};
-
-	return &(var[var_num]);
+	//Номер необходимого оператора из массива var[] вычислен в конструкторе
+	return &(var[var_offset[oper_num]]);
 };
 
 graph::operators_types graph::oper_type(uint var_num)
@@ -313,15 +1025,128 @@ graph::operators_types graph::oper_type(uint var_num)
 	return comb[oper_num];
 }
 
-graph& graph::operator= (const graph &other)
+std::string graph::structure_key(std::vector<uint> &_label)
 {
-	if(this == &other) return *this;
-	graph(other.p, other.bs, other.dc, other.w);
-	edges = other.edges;
-	var = other.var;
-	comb = other.comb;
-	
-	return *this; 
+	const uint n = comb.size();
+
+	//! Ячейки матрицы амплитуд, от которых зависит матрица истинности
+	const std::vector<uint> cells = used_cells();
+
+	//! Одночлены ячеек - коды переходов (оператор << 2) | (вход << 1) | выход, см. fold_code()
+	std::vector<std::vector<std::vector<uint> > > poly(cells.size());
+	{
+		// Для путевых движков траектории те же, что уже лежат в traj
+		fill_traj();
+
+		for(size_t c = 0; c < cells.size(); ++c)
+		for(auto &span : traj[cells[c] / p][cells[c] % p])
+		{
+			const uint *t = traj_arena.data() + span.offset;
+
+			std::vector<uint> mono;
+			for(size_t k = 1; k < span.len - 1; k += 2)
+			mono.push_back(fold_code(2*t[k] + t[k+1] % 2));
+			poly[c].push_back(mono);
+		}
+	}
+
+	//! Инвариант оператора при перенумерации: (ячейка, степень одночлена, вход-выход) всех вхождений
+	std::vector<std::vector<uint> > sig(n);
+	for(size_t c = 0; c < poly.size(); ++c)
+	for(auto &mono : poly[c])
+	for(auto h : mono)
+	sig[h >> 2].push_back((c*(n + 1) + mono.size())*4 + (h & 3));
+
+	for(auto &s : sig)
+	std::sort(s.begin(), s.end());
+
+	// Типы в comb идут блоками по порядку enum, поэтому номера не выходят из блока своего типа
+	std::vector<uint> ops(n);
+	for(uint o = 0; o < n; ++o) ops[o] = o;
+	std::stable_sort(ops.begin(), ops.end(), [&](uint _a, uint _b) {
+		return comb[_a] != comb[_b] ? comb[_a] < comb[_b] : sig[_a] < sig[_b];
+	});
+
+	//! Группы операторов, неотличимых по инварианту: их перестановки перебираются
+	std::vector<std::pair<uint, uint> > groups;
+	{
+		size_t count = 1;
+		for(uint b = 0, e; b < n; b = e)
+		{
+			for(e = b + 1; e < n && comb[ops[e]] == comb[ops[b]] && sig[ops[e]] == sig[ops[b]]; ++e);
+
+			// Операторы вне используемых ячеек на ключ не влияют
+			if(e - b < 2 || sig[ops[b]].empty()) continue;
+
+			groups.push_back(std::make_pair(b, e));
+			for(uint k = 2; k <= e - b && count <= STRUCTURE_PERMUTATIONS_MAX; ++k)
+			count *= k;
+		}
+
+		if(count > STRUCTURE_PERMUTATIONS_MAX)
+		groups.clear();
+	}
+
+	std::vector<uint> key, code, label(n);
+	for(;;)
+	{
+		for(uint r = 0; r < n; ++r)
+		label[ops[r]] = r;
+
+		// Запись: число одночленов ячейки, затем степень и коды каждого одночлена
+		code.clear();
+		std::vector<std::vector<uint> > cell;
+		for(auto &pc : poly)
+		{
+			cell = pc;
+			for(auto &mono : cell)
+			{
+				for(auto &h : mono)
+				h = (label[h >> 2] << 2) | (h & 3);
+				std::sort(mono.begin(), mono.end());
+			}
+			std::sort(cell.begin(), cell.end());
+
+			code.push_back(cell.size());
+			for(auto &mono : cell)
+			{
+				code.push_back(mono.size());
+				code.insert(code.end(), mono.begin(), mono.end());
+			}
+		}
+
+		if(key.empty() || code < key)
+		{
+			key.swap(code);
+			_label = label;
+		}
+
+		// Следующая перестановка групп (как у счётчика)
+		size_t g = 0;
+		for(; g < groups.size(); ++g)
+		if(std::next_permutation(ops.begin() + groups[g].first, ops.begin() + groups[g].second))
+		break;
+
+		if(g == groups.size()) break;
+	}
+
+	return std::string(reinterpret_cast<const char *>(key.data()), key.size()*sizeof(uint));
+}
+
+std::vector<double> graph::relabel_variables(const std::vector<double> &_var, const std::vector<uint> &_label, bool _inverse) const
+{
+	std::vector<double> ret(_var.size());
+
+	for(uint o = 0; o < comb.size(); ++o)
+	{
+		const uint from = _inverse ? _label[o] : o;
+		const uint to = _inverse ? o : _label[o];
+		const uint k = (comb[o] == waveplate) ? 2 : 1;
+
+		std::copy(_var.begin() + var_offset[from], _var.begin() + var_offset[from] + k, ret.begin() + var_offset[to]);
+	}
+
+	return ret;
 }
 
 std::complex<double> graph::traj_to_ampl(const std::vector<uint> _traj)
@@ -5,20 +5,64 @@
 #include <set>
 #include <complex>
 #include <string>
+#include <memory>
 #include <stdlib.h>
 #include <iostream>
 
+class static_graph_base;
+
 class graph {
 public:
 	
 	//! Тип комплексной 2D-матрицы
 	typedef std::vector<std::vector<std::complex<double> > > cmatrix_t;
 
-	//! Тип матрицы траекторий
-	typedef std::vector<std::vector<std::set<std::vector<uint> > > > traj_t;
+	/*
+	 * @brief Траектория - отрезок [offset, offset + len) арены траекторий:
+	 *  порт ввода, затем пары (вход оператора, куда смотрит его выход), ..., порт вывода
+	 */
+	struct span_t
+	{
+		uint offset;
+		uint len;
+	};
+
+	//! Тип матрицы траекторий: траектории ячейки [in][out] в лексикографическом порядке
+	typedef std::vector<std::vector<std::vector<span_t> > > traj_t;
 
 	//! Тип матрицы для просеивания
 	typedef std::vector<std::vector<bool> > smatrix_t;
+
+	/*
+	 * @brief Скомпилированная матрица траекторий.
+	 *  Все траектории лежат подряд в плоских массивах (CSR): траектории ячейки
+	 *  [in][out] занимают диапазон [cell[in*p + out], cell[in*p + out + 1])
+	 *  массива path, а переходы траектории t - диапазон [path[t], path[t + 1])
+	 *  массива hop.
+	 */
+	struct program_t
+	{
+		std::vector<uint> cell;	//!< Смещения ячеек в path, размер p*p + 1
+		std::vector<uint> path;	//!< Смещения траекторий в hop
+		std::vector<uint> hop;	//!< Переходы: (оператор << 2) | (вход << 1) | выход
+	};
+
+	/*
+	 * @brief Матрица амплитуд как программа без повторных подвыражений (symbolicTape).
+	 *  Регистр 0 - единица, регистры 1..leaf.size() - элементы func, а команда k
+	 *  пишет регистр 1 + leaf.size() + k: произведение (kind 0) или сумму (kind 1)
+	 *  регистров a[k] и b[k]. Одинаковые команды строятся один раз, поэтому общие
+	 *  начала траекторий и повторяющиеся одночлены вычисляются однократно.
+	 *  Команды ячеек, которые использует translate, идут первыми.
+	 */
+	struct tape_t
+	{
+		std::vector<uint> leaf;		//!< Коды переходов листьев
+		std::vector<uint> kind;		//!< Вид команды
+		std::vector<uint> a, b;		//!< Аргументы команд
+		std::vector<int> cell;		//!< Регистр ячейки [in*p + out], -1 - траекторий нет
+		uint used;					//!< Команд, нужных ячейкам из translate
+	};
 	
 	//! Поддерживаемые типы однокубитовых элементов
 	enum operators_types
@@ -27,6 +71,31 @@ public:
         directCoupler,
         waveplate
 	};
+
+	/*
+	 * @brief Рабочие массивы пакетного вычисления отклонений.
+	 *  У каждого потока свои, тогда один граф вычисляется из многих потоков сразу.
+	 *  Все массивы хранятся по наборам переменных, [элемент][набор], а комплексные
+	 *  числа - раздельно действительной и мнимой частью (для ядер simd.hpp).
+	 */
+	struct batch_t
+	{
+		std::vector<double> func_re, func_im;	//!< Таблицы func, [код перехода][набор]
+		std::vector<double> ampl_re, ampl_im;	//!< Матрицы амплитуд, [ячейка][набор]
+		std::vector<double> wave_re, wave_im;	//!< Амплитуды на узлах (transferMatrix), [узел][набор]
+		std::vector<double> prod_re, prod_im;	//!< Произведения вдоль траектории (pathEnumeration)
+		std::vector<double> root_a, root_b;		//!< sqrt(v) и sqrt(1 - v) светоделителей
+		std::vector<double> tape_re, tape_im;	//!< Регистры tape_t (symbolicTape), [регистр][набор]
+	};
+
+	//! Способы вычисления матрицы амплитуд
+	enum engines_types
+	{
+		pathEnumeration,	//!< Явный перебор всех траекторий (make_matrix_traj)
+		transferMatrix,		//!< Распространение амплитуд по ациклическому графу
+		symbolicTape,		//!< Программа tape_t, собранная из траекторий (compile_tape)
+		staticKernel		//!< Шаблон static_graph под размер графа, иначе transferMatrix
+	};
 	/*
      * @brief Конструктор по умолчанию
      *
@@ -40,6 +109,17 @@ public:
 	//! Установить рёбра графа
 	void set_edges(const std::vector<uint> &_edges);
 
+	/*
+	 * @brief Выбирает способ вычисления матрицы амплитуд.
+	 *  transferMatrix не перебирает траектории: амплитуды от каждого порта ввода
+	 *  проталкиваются через операторы в топологическом порядке за O(p*(q+p)),
+	 *  а просеивание выполняется по битовым маскам достижимости (p <= 64).
+	 * 
+	 * @param _engine	Способ вычисления
+	 */
+	void set_engine(engines_types _engine);
+	engines_types get_engine();
+
 	//! Вернуть рёбра графа
 	std::vector<uint> get_edges();
 
@@ -51,6 +131,31 @@ public:
 	 * @return Текущее значение эффективности
 	 */
 	double get_deviation();
+
+	/*
+	 * @brief Вернуть отклонение вместе с его точным градиентом по var[].
+	 *  Градиент считается обратным проходом (reverse-mode) через матрицу
+	 *  истинности, матрицу амплитуд и таблицу операторов func.
+	 *  В точке, где ячейка матрицы истинности совпадает с целевой,
+	 *  её вклад в градиент полагается нулевым.
+	 * 
+	 * @param _grad		Сюда пишется градиент (размер как у get_variables())
+	 * 
+	 * @return Текущее значение отклонения
+	 */
+	double get_deviation(std::vector<double> &_grad);
+
+	/*
+	 * @brief Отклонения для _n наборов переменных за один проход по структуре графа.
+	 *  Граф не меняется, поэтому вызов безопасен из многих потоков, если у каждого свой _ws.
+	 *  Результат совпадает с set_variables() + get_deviation() для каждого набора.
+	 * 
+	 * @param _x		Наборы по столбцам (SoA): переменная k набора s лежит в _x[k*_n + s]
+	 * @param _n		Число наборов
+	 * @param _dev		Сюда пишутся _n отклонений
+	 * @param _ws		Рабочие массивы
+	 */
+	void get_deviation(const double *_x, size_t _n, double *_dev, batch_t &_ws) const;
 	
 	/*
 	 * Возвращает матрицу амплитуд для текущего графа и текущих переменных
@@ -94,7 +199,41 @@ public:
 	 */
 	bool sift(const smatrix_t &_sM);
 
-	graph& operator= (const graph &other);
+	/*
+	 * @brief Просеивание по маскам достижимости, без построения траекторий.
+	 *  Используется sift(), а также сифтером для отсечения частично построенных графов.
+	 * 
+	 * @param _reach	Для каждого порта вывода - битовая маска портов ввода,
+	 * 					из которых в него есть траектория
+	 * 
+	 * @return true в случае просеянного графа. Иначе false.
+	 */
+	bool sift_reach(const std::vector<u_int64_t> &_reach);
+
+	/*
+	 * @brief Каноническая запись символьной структуры графа.
+	 *  Ячейки матрицы амплитуд, которые использует translate, - это многочлены от
+	 *  элементов операторов: сумма по траекториям произведений кодов переходов.
+	 *  Запись перебирает перенумерации операторов одного типа и выбирает
+	 *  наименьшую, поэтому у графов с одинаковыми ключами одинаковые отклонения
+	 *  при соответственно переставленных переменных (см. relabel_variables()).
+	 *  Ключи сравнимы только у графов одного размера.
+	 * 
+	 * @param _label	Сюда пишется канонический номер каждого оператора
+	 * 
+	 * @return Ключ в виде строки байт
+	 */
+	std::string structure_key(std::vector<uint> &_label);
+
+	/*
+	 * @brief Переставляет переменные по нумерации из structure_key():
+	 *  переменные оператора o переходят к оператору _label[o], при _inverse - обратно.
+	 *  Переменные канонической нумерации переносятся между графами с одним ключом.
+	 */
+	std::vector<double> relabel_variables(const std::vector<double> &_var, const std::vector<uint> &_label, bool _inverse = false) const;
+
+	// Копирование и присваивание - по умолчанию, почленно: все члены - значения,
+	// кроме fixed, который копии делят (см. ниже)
 	
 protected:
 
@@ -110,6 +249,50 @@ protected:
 	//! Матрица траекторий
 	traj_t traj;
 
+	//! Арена траекторий: все траектории графа подряд. При смене рёбер очищается
+	//! без освобождения памяти, поэтому set_edges() не выделяет память в куче
+	std::vector<uint> traj_arena;
+
+	//! Стек текущей траектории в paths()
+	std::vector<uint> way;
+
+	//! Скомпилированная матрица траекторий
+	program_t prog;
+
+	//! Программа без повторных подвыражений (для symbolicTape)
+	tape_t tape;
+
+	//! Значения регистров tape и сопряжённые к ним при вычислении градиента
+	std::vector<std::complex<double> > tape_val, tape_adj;
+
+	//! Отклонение графа фиксированного размера (для staticKernel). Не меняется после
+	//! создания, поэтому копии графа делят его. NULL - размер не собран.
+	std::shared_ptr<const static_graph_base> fixed;
+
+	//! fixed не соответствует рёбрам или целевой матрице и пересоздаётся в get_deviation()
+	bool fixedStale;
+
+	//! Способ вычисления матрицы амплитуд
+	engines_types engine;
+
+	//! Топологический порядок операторов (для transferMatrix)
+	std::vector<uint> order;
+
+	//! Битовые маски портов ввода, из которых достижим каждый порт вывода
+	std::vector<u_int64_t> reach;
+
+	//! Амплитуды на узлах графа при распространении от одного порта ввода
+	std::vector<std::complex<double> > wave;
+
+	//! Буфер матрицы амплитуд (p*p, построчно) для вычислений без выделения памяти
+	std::vector<std::complex<double> > ampl;
+
+	//! Сопряжённые (adjoint) переменные для ampl, func и wave при вычислении градиента
+	std::vector<std::complex<double> > ampl_adj, func_adj, wave_adj;
+
+	//! Префиксные произведения вдоль траектории при вычислении градиента
+	std::vector<std::complex<double> > prefix;
+
 	uint p;     //!< p(orts) - число портов ввода-вывода
 	uint bs;    //!< (beamsplitters) - число светоделительных пластинок
 	uint dc;    //!< (direction couplers) - число направленных светоделителей
@@ -119,15 +302,85 @@ protected:
 	
 	std::vector<double> var;//Внутренние параметры графа
 
+	//! Номер первой переменной в var[] для каждого оператора
+	std::vector<uint> var_offset;
+
+	/*
+	 * @brief Таблица матриц 2x2 всех операторов для текущих var[].
+	 *  Элемент (in, out) оператора oper_num лежит в func[(oper_num << 2) | (in << 1) | out],
+	 *  что совпадает с кодом перехода в program_t::hop.
+	 */
+	std::vector<std::complex<double> > func;
+
 	//! Целевая матрица
 	cmatrix_t targetMatrix;
 
 	//! Матрица конвертации матрицы амплитуд (или траекторий) в матрицу истинности
 	std::vector<std::vector<std::vector<uint> > > translate;
 
-	//! Создаёт матрицу траекторий
+	//! Создаёт матрицу траекторий и компилирует её в prog
 	void make_matrix_traj();
 
+	//! Заполняет traj и traj_arena по текущим рёбрам
+	void fill_traj();
+
+	//! Компилирует матрицу траекторий traj в плоскую программу prog
+	void compile_program();
+
+	//! Собирает программу tape из prog
+	void compile_tape();
+
+	//! Создаёт fixed по рёбрам, порядку order и целевой матрице и снимает fixedStale
+	void make_static();
+
+	//! Заполняет буфер ampl по программе tape. Без _all - только ячейки из translate
+	void eval_tape(bool _all);
+
+	//! Переносит ampl_adj на func_adj обратным проходом по tape
+	void adjoint_tape();
+
+	//! Ячейки матрицы амплитуд (in*p + out), от которых зависит матрица истинности, по возрастанию
+	std::vector<uint> used_cells() const;
+
+	/*
+	 * @brief Код перехода в символьных записях: равные элементы матриц make_func()
+	 *  получают один код - u[2] = u[1] у всех типов, u[3] = u[0] у направленного светоделителя.
+	 */
+	uint fold_code(uint _h) const;
+
+	//! Пересчитывает таблицу func по текущим var[]
+	void update_func();
+
+	//! Заполняет буфер ampl по скомпилированной программе
+	void eval_program();
+
+	//! Находит топологический порядок операторов и маски достижимости
+	void make_order();
+
+	//! Заполняет буфер ampl распространением амплитуд в порядке order
+	void eval_transfer();
+
+	//! Заполняет буфер ampl выбранным способом. Без _all ячейки вне translate могут не вычисляться
+	void eval_amplitude(bool _all = true);
+
+	//! Переносит ampl_adj на func_adj по скомпилированной программе
+	void adjoint_program();
+
+	//! Переносит ampl_adj на func_adj обратным распространением по order
+	void adjoint_transfer();
+
+	//! Переносит func_adj на градиент по var[]
+	void adjoint_func(std::vector<double> &_grad);
+
+	/*
+	 * @brief Вычисляет ячейку матрицы истинности по матрице амплитуд ampl
+	 * 
+	 * @param i, j		Ячейка матрицы истинности
+	 * 
+	 * @return T[i][j] = A*B + C*D
+	 */
+	std::complex<double> truth_cell(uint i, uint j);
+
     /*
      * @brief Возвращает указатель на переменную из массива var[], соответствующей
      *  однокубитовому оператору comb->op[oper_num]. Если для данного
@@ -148,15 +401,20 @@ protected:
 	 * @return Комплексная амплитуда однокубитового оператора
 	 */
 	std::complex<double> get_func(uint oper_num, uint in, uint out);
+
+	/*
+	 * @brief Матрица 2x2 оператора: _u[(in << 1) | out]
+	 * 
+	 * @param _type		Тип оператора
+	 * @param _v		Переменные оператора (две у волновой пластинки)
+	 */
+	static void make_func(operators_types _type, const double *_v, std::complex<double> *_u);
 	
 	//Определяет какому типу однокубитового оператора принадлежит переменная с номером var_num
 	operators_types oper_type(uint var_num);
 
-	//! Рекурсивно находит все возможные пути
-	void paths(
-		uint start, 
-		traj_t &matrix, 
-		std::vector<uint> way = std::vector<uint>());	
+	//! Рекурсивно находит все возможные пути, продолжающие way, и дописывает их в traj
+	void paths(uint start);
 
 	/*
 	 * @brief Конвертирует тректорию в комплексную амплитуду
@@ -0,0 +1,259 @@
+#ifndef GRAPHFILE_CPP
+#define GRAPHFILE_CPP
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "graphfile.hpp"
+#include "trace.hpp"
+
+//! Смещение целевой матрицы: сразу за матрицей просеивания, с выравниванием на 8 байт
+static size_t target_offset(uint _p)
+{
+	return (sizeof(graphfile_header_t) + _p*_p + 7) / 8 * 8;
+}
+
+/*
+ * @brief Проверяет заголовок файла длиной _length: размер записи соответствует
+ *  размерам графа (узлов не больше 64), а записи начинаются за целевой матрицей
+ *  и не дальше конца файла. Тогда матрицы и записи не выходят за пределы файла.
+ */
+static bool header_valid(const graphfile_header_t &_h, size_t _length)
+{
+	return
+		memcmp(_h.magic, "QSSG", 4) == 0 &&
+		_h.version == GRAPHFILE_VERSION &&
+		_h.record_size != 0 && _h.record_size <= 64 &&
+		_h.record_size == u_int64_t(_h.p) + 2*(u_int64_t(_h.bs) + _h.dc + _h.w) &&
+		_h.data_offset >= target_offset(_h.p) + _h.p*_h.p*2*sizeof(double) &&
+		_h.data_offset <= _length;
+}
+
+graph_writer::graph_writer()
+{
+	file = NULL;
+}
+
+graph_writer::~graph_writer()
+{
+	close();
+}
+
+bool graph_writer::open(
+	const std::string &_path,
+	uint _p, uint _bs, uint _dc, uint _w,
+	const graph::smatrix_t &_sM,
+	const graph::cmatrix_t &_tM)
+{
+	close();
+
+	file = fopen(_path.c_str(), "wb");
+	if(file == NULL) return false;
+
+	graphfile_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "QSSG", 4);
+	h.version = GRAPHFILE_VERSION;
+	h.p = _p;
+	h.bs = _bs;
+	h.dc = _dc;
+	h.w = _w;
+	h.record_size = _p + 2*(_bs + _dc + _w);
+	h.data_offset = target_offset(_p) + _p*_p*2*sizeof(double);
+
+	std::vector<unsigned char> head(h.data_offset, 0);
+	memcpy(head.data(), &h, sizeof(h));
+
+	for(size_t i = 0; i < _p; ++i)
+	for(size_t j = 0; j < _p; ++j)
+	head[sizeof(h) + i*_p + j] = _sM[i][j];
+
+	double *t = reinterpret_cast<double *>(head.data() + target_offset(_p));
+	for(size_t i = 0; i < _p; ++i)
+	for(size_t j = 0; j < _p; ++j)
+	{
+		t[2*(i*_p + j)] = _tM[i][j].real();
+		t[2*(i*_p + j) + 1] = _tM[i][j].imag();
+	}
+
+	fwrite(head.data(), 1, head.size(), file);
+	record.resize(h.record_size);
+
+	return true;
+}
+
+bool graph_writer::append(const std::string &_path, uint _p, uint _bs, uint _dc, uint _w)
+{
+	close();
+
+	int fd = ::open(_path.c_str(), O_RDWR);
+	if(fd < 0) return false;
+
+	graphfile_header_t h;
+	struct stat st;
+	if(
+		fstat(fd, &st) != 0 ||
+		pread(fd, &h, sizeof(h), 0) != ssize_t(sizeof(h)) ||
+		!header_valid(h, st.st_size) ||
+		h.p != _p || h.bs != _bs || h.dc != _dc || h.w != _w
+	) {
+		::close(fd);
+		return false;
+	}
+
+	const off_t whole = h.data_offset + (st.st_size - h.data_offset) / h.record_size * h.record_size;
+	if(ftruncate(fd, whole) != 0 || lseek(fd, 0, SEEK_END) < 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	file = fdopen(fd, "ab");
+	if(file == NULL)
+	{
+		::close(fd);
+		return false;
+	}
+
+	record.resize(h.record_size);
+	return true;
+}
+
+void graph_writer::write(const std::vector<uint> &_edges)
+{
+	encode(_edges, record.data());
+	fwrite(record.data(), 1, record.size(), file);
+}
+
+void graph_writer::encode(const std::vector<uint> &_edges, unsigned char *_record)
+{
+	for(size_t i = 0; i < _edges.size(); ++i)
+	_record[i] = _edges[i];
+}
+
+int graph_writer::descriptor()
+{
+	if(file == NULL) return -1;
+
+	fflush(file);
+	return fileno(file);
+}
+
+void graph_writer::flush()
+{
+	TRACE_SCOPE("flush");
+	if(file != NULL) fflush(file);
+}
+
+void graph_writer::close()
+{
+	if(file != NULL) fclose(file);
+	file = NULL;
+}
+
+graph_reader::graph_reader()
+{
+	data = NULL;
+	length = 0;
+	header = NULL;
+	records = 0;
+}
+
+graph_reader::~graph_reader()
+{
+	close();
+}
+
+bool graph_reader::open(const std::string &_path)
+{
+	close();
+
+	int fd = ::open(_path.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(graphfile_header_t))
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(m == MAP_FAILED) return false;
+
+	data = static_cast<const unsigned char *>(m);
+	length = st.st_size;
+	header = reinterpret_cast<const graphfile_header_t *>(data);
+
+	if(!header_valid(*header, length))
+	{
+		close();
+		return false;
+	}
+
+	records = (length - header->data_offset) / header->record_size;
+
+	// Записи читаются по порядку - подскажем ядру читать вперёд
+	madvise(m, length, MADV_SEQUENTIAL);
+
+	return true;
+}
+
+void graph_reader::close()
+{
+	if(data != NULL) munmap(const_cast<unsigned char *>(data), length);
+	data = NULL;
+	length = 0;
+	header = NULL;
+	records = 0;
+}
+
+uint graph_reader::p() const { return header->p; }
+uint graph_reader::bs() const { return header->bs; }
+uint graph_reader::dc() const { return header->dc; }
+uint graph_reader::w() const { return header->w; }
+
+size_t graph_reader::size() const
+{
+	return records;
+}
+
+graph::smatrix_t graph_reader::sift_matrix() const
+{
+	const uint p = header->p;
+	graph::smatrix_t ret(p, std::vector<bool>(p));
+
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	ret[i][j] = data[sizeof(graphfile_header_t) + i*p + j];
+
+	return ret;
+}
+
+graph::cmatrix_t graph_reader::target_matrix() const
+{
+	const uint p = header->p;
+	graph::cmatrix_t ret(p, std::vector<std::complex<double> >(p));
+
+	const double *t = reinterpret_cast<const double *>(data + target_offset(p));
+	for(size_t i = 0; i < p; ++i)
+	for(size_t j = 0; j < p; ++j)
+	ret[i][j] = std::complex<double>(t[2*(i*p + j)], t[2*(i*p + j) + 1]);
+
+	return ret;
+}
+
+void graph_reader::get(size_t i, std::vector<uint> &_edges) const
+{
+	const unsigned char *r = data + header->data_offset + i * header->record_size;
+
+	_edges.resize(header->record_size);
+	for(size_t k = 0; k < header->record_size; ++k)
+	_edges[k] = r[k];
+}
+
+#endif //! GRAPHFILE_CPP
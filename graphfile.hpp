@@ -0,0 +1,127 @@
+#ifndef GRAPHFILE_HPP
+#define GRAPHFILE_HPP
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "graph.hpp"
+
+/*
+ * Бинарный список графов между сифтером и оптимизатором:
+ *
+ *  graphfile_header_t
+ *  матрица просеивания     p*p байт (0/1), построчно
+ *  целевая матрица         p*p пар double (re, im), построчно, с выравниванием на 8 байт
+ *  записи                  по record_size байт: рёбра графа, по байту на ребро
+ *
+ * Число записей определяется размером файла, поэтому файл прерванного
+ * сифтера читается до последней целой записи.
+ */
+struct graphfile_header_t
+{
+	char magic[4];			//!< "QSSG"
+	u_int32_t version;		//!< GRAPHFILE_VERSION
+	u_int32_t p;			//!< Число портов ввода-вывода
+	u_int32_t bs;			//!< Число светоделительных пластинок
+	u_int32_t dc;			//!< Число направленных светоделителей
+	u_int32_t w;			//!< Число волновых пластинок
+	u_int32_t record_size;	//!< Байт на запись, p + 2*(bs+dc+w)
+	u_int32_t reserved;
+	u_int64_t data_offset;	//!< Смещение первой записи от начала файла
+};
+
+#define GRAPHFILE_VERSION 1
+
+//! Последовательная запись бинарного списка графов
+class graph_writer {
+public:
+	graph_writer();
+	~graph_writer();
+
+	/*
+	 * @brief Создаёт файл и пишет заголовок
+	 *
+	 * @param _path		Имя файла
+	 * @param _sM		Матрица просеивания
+	 * @param _tM		Целевая матрица
+	 *
+	 * @return false, если файл не удалось создать
+	 */
+	bool open(
+		const std::string &_path,
+		uint _p, uint _bs, uint _dc, uint _w,
+		const graph::smatrix_t &_sM,
+		const graph::cmatrix_t &_tM);
+
+	/*
+	 * @brief Открывает существующий файл для дописывания (возобновление сифтера).
+	 *  Неполная последняя запись прерванного процесса отрезается.
+	 *
+	 * @return false, если файла нет или его заголовок не совпадает с _p, _bs, _dc, _w
+	 */
+	bool append(const std::string &_path, uint _p, uint _bs, uint _dc, uint _w);
+
+	//! Дописывает граф в конец файла. Не потокобезопасно.
+	void write(const std::vector<uint> &_edges);
+
+	//! Сбрасывает буферы на диск
+	void flush();
+
+	/*
+	 * @brief Сбрасывает буферы и возвращает дескриптор файла для записи в обход write()
+	 *  (например, через buffered_output). Записи пишутся в конец файла.
+	 */
+	int descriptor();
+
+	//! Запись графа в файле: по байту на ребро, _edges.size() байт в _record
+	static void encode(const std::vector<uint> &_edges, unsigned char *_record);
+
+	void close();
+
+protected:
+	FILE *file;
+	std::vector<unsigned char> record;
+};
+
+/*
+ * @brief Чтение бинарного списка графов через mmap.
+ *  После open() все методы константные и могут вызываться из любых потоков без блокировок.
+ */
+class graph_reader {
+public:
+	graph_reader();
+	~graph_reader();
+
+	/*
+	 * @brief Отображает файл в память
+	 *
+	 * @return false, если файл не открывается или это не бинарный список графов
+	 */
+	bool open(const std::string &_path);
+
+	void close();
+
+	uint p() const;
+	uint bs() const;
+	uint dc() const;
+	uint w() const;
+
+	//! Число графов в файле
+	size_t size() const;
+
+	graph::smatrix_t sift_matrix() const;
+	graph::cmatrix_t target_matrix() const;
+
+	//! Читает рёбра i-го графа в _edges (размер p + 2*(bs+dc+w))
+	void get(size_t i, std::vector<uint> &_edges) const;
+
+protected:
+	const unsigned char *data;
+	size_t length;
+	const graphfile_header_t *header;
+	size_t records;
+};
+
+#endif //! GRAPHFILE_HPP
@@ -0,0 +1,272 @@
+#ifndef OPTIMIZE_CPP
+#define OPTIMIZE_CPP
+
+#include <iostream>
+#include <random>
+#include <algorithm>
+
+#include <omp.h>
+
+#include "optimize.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
+
+//! Состояние запуска NLopt с порогом досрочной остановки
+struct cutoff_run_t
+{
+    graph *g;
+    nlopt::opt *opt;
+    cutoff_t *cutoff;
+
+    double start;       //!< Время начала запуска
+    double maxtime;     //!< Время, отведённое запуску
+    uint evals;         //!< Вычислений целевой функции
+    double best;        //!< Лучшее значение запуска
+    double t0, f0;      //!< Время и лучшее значение на конце разгона (warmup)
+    bool stopped;       //!< force_stop() уже вызван
+};
+
+/*
+ * @brief Целевая функция с проверкой порога cutoff_t.
+ *  Проверка идёт после каждого вычисления, начиная с warmup-го: средняя скорость
+ *  спуска с конца разгона переносится на оставшееся время запуска.
+ */
+static double cutoff_function(const std::vector<double> &x, std::vector<double> &grad, void *data)
+{
+    cutoff_run_t *r = reinterpret_cast<cutoff_run_t *>(data);
+
+    const double f = target_function(x, grad, r->g);
+    r->best = std::min(r->best, f);
+
+    if(++r->evals < r->cutoff->warmup) return f;
+
+    const double t = omp_get_wtime() - r->start;
+    if(r->evals == r->cutoff->warmup)
+    {
+        r->t0 = t;
+        r->f0 = r->best;
+        return f;
+    }
+
+    const double rate = (t > r->t0) ? (r->f0 - r->best) / (t - r->t0) : 0;
+    const double projected = r->best - rate * std::max(r->maxtime - t, 0.);
+    if(!r->stopped && projected > r->cutoff->threshold())
+    {
+        r->stopped = true;
+        ++r->cutoff->aborted;
+        r->opt->force_stop();
+    }
+
+    return f;
+}
+
+void NLopt(
+    graph &_g, 
+    double _eps, 
+    nlopt::algorithm _local, 
+    const std::vector<double> &_x0,
+    cutoff_t *_cutoff,
+    double _maxtime)
+{
+    TRACE_SCOPE("NLopt");
+    const uint v = _g.get_variables().size();
+
+    // std::cout << "Setting glob_problem" << std::endl;
+    // //! Поиск глобального оптимума, без производных
+    nlopt::opt glob_problem(nlopt::AUGLAG, v);
+    
+    // std::cout << "Setting min_objective" << std::endl;
+    cutoff_run_t run;
+    if(_cutoff == NULL)
+    glob_problem.set_min_objective(&target_function, (void*)&_g);
+    else
+    {
+        run.g = &_g;
+        run.opt = &glob_problem;
+        run.cutoff = _cutoff;
+        run.start = omp_get_wtime();
+        run.maxtime = _maxtime;
+        run.evals = 0;
+        run.best = __DBL_MAX__;
+        run.stopped = false;
+        glob_problem.set_min_objective(&cutoff_function, (void*)&run);
+    }
+
+    //! Устанавливаем границы изменения переменных
+    std::vector<double> lb(v, 0), ub(v, 1);
+    glob_problem.set_lower_bounds(lb);
+    glob_problem.set_upper_bounds(ub);
+
+    //Задаём конечную точность установления переменных
+    glob_problem.set_xtol_abs(_eps);
+
+    {
+        // std::cout << "Setting loc_problem" << std::endl;
+        //! Локальный оптимизатор
+        nlopt::opt loc_problem(_local, v);
+        loc_problem.set_xtol_abs(_eps);
+        //ПРЕЖДЕ локальный оптимизатор надо конфигурировать ДО того как 
+        //передать его для _копирования_ глобальному. 
+        glob_problem.set_local_optimizer(loc_problem);
+    }
+
+    double result;
+    std::vector<double> grad(v);
+    std::vector<double> x = _x0.empty() ? std::vector<double>(v, 0.5) : _x0;
+
+    glob_problem.set_maxtime(_maxtime);
+    global_telemetry().add(telemetry::nloptRuns);
+    // std::cout << "Optimizing..." << std::endl;
+    // Градиентные алгоритмы на негладкой целевой функции могут завершиться
+    // с nlopt::roundoff_limited или nlopt::failure (std::runtime_error), а cutoff_function() -
+    // с nlopt::forced_stop. В x остаётся последняя точка. Остальные исключения
+    // (std::bad_alloc, std::invalid_argument) - ошибки, а не остановка запуска
+    try
+    {
+        glob_problem.optimize(x, result);
+    }
+    catch(const nlopt::roundoff_limited &) {}
+    catch(const nlopt::forced_stop &) {}
+    catch(const std::runtime_error &) {}
+
+    // В графе должны остаться найденные параметры, а не последние вычисленные
+    _g.set_variables(x);
+}
+
+double multistart(
+    graph &_g, 
+    double _eps, 
+    nlopt::algorithm _local, 
+    uint _starts, 
+    uint _runs, 
+    unsigned _seed,
+    cutoff_t *_cutoff,
+    double _maxtime)
+{
+    TRACE_SCOPE("multistart");
+    const size_t v = _g.get_variables().size();
+    const size_t n = std::max<uint>(_starts, 1);
+    _runs = std::min<uint>(std::max<uint>(_runs, 1), n);
+
+    //! Начальные точки по столбцам (SoA): переменная k точки s - x[k*n + s]
+    std::vector<double> x(v * n);
+    {
+        std::mt19937 rng(_seed);
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        for(size_t k = 0; k < v; ++k)
+        for(size_t s = 0; s < n; ++s)
+        x[k*n + s] = (s == 0) ? 0.5 : uniform(rng);
+    }
+
+    std::vector<double> dev(n);
+    {
+        graph::batch_t ws;
+        _g.get_deviation(x.data(), n, dev.data(), ws);
+        global_telemetry().add(telemetry::deviations, n);
+    }
+
+    std::vector<uint> order(n);
+    for(uint s = 0; s < n; ++s) order[s] = s;
+    std::partial_sort(order.begin(), order.begin() + _runs, order.end(), 
+        [&dev](uint _a, uint _b) { return dev[_a] < dev[_b]; });
+
+    double best = __DBL_MAX__;
+    std::vector<double> bestVar;
+
+    // Внутри уже активной параллельной области вложенная область получит один поток
+    #pragma omp parallel for schedule(dynamic)
+    for(uint r = 0; r < _runs; ++r)
+    {
+        std::vector<double> x0(v);
+        for(size_t k = 0; k < v; ++k)
+        x0[k] = x[k*n + order[r]];
+
+        graph g = _g;
+        NLopt(g, _eps, _local, x0, _cutoff, _maxtime);
+        const double d = g.get_deviation();
+
+        #pragma omp critical(multistart)
+        if(d < best)
+        {
+            best = d;
+            bestVar = g.get_variables();
+        }
+    }
+
+    _g.set_variables(bestVar);
+    return best;
+}
+
+double target_function(const std::vector<double> &x, std::vector<double> &grad, void * data)
+{
+    graph *g = reinterpret_cast<graph *>(data);
+
+    g->set_variables(x);
+    global_telemetry().add(telemetry::deviations);
+    
+    // Градиент запрашивают только алгоритмы семейства LD_*
+    double ret = grad.empty() ? g->get_deviation() : g->get_deviation(grad);
+    // std::cout << "\tDeviation = " << ret << std::endl;
+    return ret;
+}
+
+void print_graph(graph &_g)
+{
+    using namespace std;
+
+    cout << "Edges:" << endl;
+    for(auto j : _g.get_edges())
+    cout << j << '\t';
+    cout << endl;
+
+    cout << "Variables:" << endl << '\t';
+    for(auto j : _g.get_variables())
+    cout << j << '\t';
+    cout << endl;
+
+    cout << "\tMatrix amplitude:" << endl;
+    graph::cmatrix_t MAmp = _g.get_matrix_amplitude();
+    for(size_t i = 0; i < MAmp.size(); ++i)
+    {
+        cout << "\t\t";
+        for(size_t j = 0; j < MAmp.size(); ++j)
+        cout << MAmp[i][j] << '\t';
+
+        cout << endl;
+    }
+
+    cout << "\tMatrix truth:" << endl;
+    graph::cmatrix_t MTruth = _g.get_matrix_truth();
+    for(size_t i = 0; i < MTruth.size(); ++i)
+    {
+        cout << "\t\t";
+        for(size_t j = 0; j < MTruth.size(); ++j)
+        cout << MTruth[i][j] << '\t';
+
+        cout << endl;
+    }
+}
+
+bool parse_engine(const std::string &_name, graph::engines_types &_engine)
+{
+    if(_name == "transfer") _engine = graph::transferMatrix; else
+    if(_name == "paths") _engine = graph::pathEnumeration; else
+    if(_name == "tape") _engine = graph::symbolicTape; else
+    if(_name == "static") _engine = graph::staticKernel; else
+    return false;
+
+    return true;
+}
+
+bool parse_local(const std::string &_name, nlopt::algorithm &_local)
+{
+    if(_name == "cobyla") _local = nlopt::LN_COBYLA; else
+    if(_name == "lbfgs") _local = nlopt::LD_LBFGS; else
+    if(_name == "slsqp") _local = nlopt::LD_SLSQP; else
+    if(_name == "mma") _local = nlopt::LD_MMA; else
+    return false;
+
+    return true;
+}
+
+#endif //! OPTIMIZE_CPP
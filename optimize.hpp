@@ -0,0 +1,105 @@
+#ifndef OPTIMIZE_HPP
+#define OPTIMIZE_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <nlopt.hpp>
+#include "graph.hpp"
+
+//! Время одного запуска NLopt по умолчанию, с
+#define NLOPT_MAXTIME   1e-2
+
+double target_function(const std::vector<double> &x, std::vector<double> &grad, void * data);
+
+/*
+ * @brief Общий порог для досрочной остановки бесперспективных запусков NLopt.
+ *  Потоки публикуют в best лучшее найденное отклонение. Запуск, сделавший больше
+ *  warmup вычислений, экстраполирует свою кривую сходимости на оставшееся время:
+ *  если даже при сохранении средней скорости спуска он к концу не опустится
+ *  ниже best*ratio + slack, то он останавливается через force_stop().
+ */
+struct cutoff_t
+{
+    cutoff_t(double _ratio = 1.2, double _slack = 0.05, uint _warmup = 20) :
+        best(__DBL_MAX__), ratio(_ratio), slack(_slack), warmup(_warmup), aborted(0) {}
+
+    //! Понижает best до _dev, если _dev меньше
+    void publish(double _dev)
+    {
+        double cur = best.load(std::memory_order_relaxed);
+        while(_dev < cur && !best.compare_exchange_weak(cur, _dev, std::memory_order_relaxed));
+    }
+
+    //! Порог, ниже которого запуск должен успеть опуститься
+    double threshold() const
+    {
+        return best.load(std::memory_order_relaxed) * ratio + slack;
+    }
+
+    std::atomic<double> best;
+    double ratio;
+    double slack;
+    uint warmup;    //!< Вычислений целевой функции до первой проверки
+
+    std::atomic<u_int64_t> aborted;    //!< Остановленных запусков
+};
+
+/*
+ * @brief Реализация NLopt. 
+ *
+ * @param g         направленный граф
+ * @param L         логическая матрица из функций
+ * @param restrictions массив условий равенства
+ * @param eps       точность удовлетворения условиям равенства
+ * @param local     локальный оптимизатор. Для LD_* целевая функция
+ *                  возвращает аналитический градиент graph::get_deviation(grad)
+ * @param x0        начальная точка. Если пусто - все переменные 0.5
+ * @param cutoff    порог досрочной остановки. NULL - запуск идёт всё отведённое время
+ * @param maxtime   время запуска, с
+ */
+void NLopt(
+    graph &_g, 
+    double _eps, 
+    nlopt::algorithm _local = nlopt::LN_COBYLA, 
+    const std::vector<double> &_x0 = std::vector<double>(),
+    cutoff_t *_cutoff = NULL,
+    double _maxtime = NLOPT_MAXTIME);
+
+/*
+ * @brief Многостартовая оптимизация.
+ *  Отклонения в _starts начальных точках (первая - все 0.5, остальные случайные)
+ *  считаются одним пакетом graph::get_deviation(x, n, ...), и из _runs лучших
+ *  запускается NLopt() на копиях графа. Вне активной параллельной области OpenMP
+ *  запуски идут параллельно, иначе - в вызвавшем потоке.
+ *  В графе остаются переменные лучшего запуска.
+ *
+ * @param _starts   число начальных точек
+ * @param _runs     число запусков NLopt, не больше _starts
+ * @param _seed     зерно генератора начальных точек
+ * @param _cutoff   порог досрочной остановки для каждого запуска (см. NLopt())
+ * @param _maxtime  время каждого запуска, с
+ *
+ * @return отклонение лучшего запуска
+ */
+double multistart(
+    graph &_g, 
+    double _eps, 
+    nlopt::algorithm _local, 
+    uint _starts, 
+    uint _runs, 
+    unsigned _seed,
+    cutoff_t *_cutoff = NULL,
+    double _maxtime = NLOPT_MAXTIME);
+
+//! Печатает рёбра, переменные, матрицы амплитуд и истинности графа на стандартный вывод
+void print_graph(graph &_g);
+
+//! Разбирает имя способа вычисления (paths|transfer|tape|static). false - если имя неизвестно
+bool parse_engine(const std::string &_name, graph::engines_types &_engine);
+
+//! Разбирает имя локального оптимизатора (cobyla|lbfgs|slsqp|mma). false - если имя неизвестно
+bool parse_local(const std::string &_name, nlopt::algorithm &_local);
+
+#endif //! OPTIMIZE_HPP
@@ -6,205 +6,658 @@
 #include <string>
 #include <complex>
 #include <algorithm>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <math.h>
+#ifdef QSS_MPI
+#include <mpi.h>
+#endif
 
 #include <nlopt.hpp>
 #include "graph.hpp"
+#include "graphfile.hpp"
+#include "optimize.hpp"
+#include "static_graph.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
 
-double target_function(const std::vector<double> &x, std::vector<double> &grad, void * data);
+bool compare_graph (graph &_a, graph &_b) { return (_a.get_deviation() < _b.get_deviation()); }
 
 /*
- * @brief Реализация NLopt. 
+ * В MPI-сборке (QSS_MPI) список графов делится между процессами через один:
+ * процесс r оптимизирует графы r, r + size, r + 2*size, ... Графы идут раундами,
+ * после каждого раунда процессы обмениваются best_dev (MPI_Allreduce), а в
+ * конце лучшие графы всех процессов собираются на процессе 0 и печатаются им.
+ *
+ * С лестницей бюджетов (-L t1,t2,...) графы раунда проходят отбор: сначала все
+ * оптимизируются за время t1, на следующую ступень переходит лучшая доля (-f)
+ * и продолжает из найденных переменных за время t2, и так далее. Последняя
+ * ступень - обычный запуск NLopt на NLOPT_MAXTIME с порогом досрочной остановки (-c).
+ *
+ * С ключом -u графы процесса сначала разбиваются на классы по символьной структуре
+ * матрицы амплитуд (graph::structure_key()). Оптимизируется только первый граф
+ * класса, остальные получают его переменные в своей нумерации операторов.
  *
- * @param g         направленный граф
- * @param L         логическая матрица из функций
- * @param restrictions массив условий равенства
- * @param eps       точность удовлетворения условиям равенства
+ * Ход оптимизации раз в -p секунд выводится строкой JSON в стандартный поток
+ * ошибок или в файл -j (у процессов MPI - свой файл), см. telemetry.hpp.
  */
-void NLopt(graph &_g, double _eps)
+int main(int argc, char ** argv)
 {
-    const uint v = _g.get_variables().size();
-
-    // std::cout << "Setting glob_problem" << std::endl;
-    // //! Поиск глобального оптимума, без производных
-    nlopt::opt glob_problem(nlopt::AUGLAG, v);
-    
-    // std::cout << "Setting min_objective" << std::endl;
-    glob_problem.set_min_objective(&target_function, (void*)&_g);
-
-    //! Устанавливаем границы изменения переменных
-    std::vector<double> lb(v, 0), ub(v, 1);
-    glob_problem.set_lower_bounds(lb);
-    glob_problem.set_upper_bounds(ub);
-
-    //Задаём конечную точность установления переменных
-    glob_problem.set_xtol_abs(_eps);
+    using namespace std;
 
+    int MPI_rank = 0, MPI_size = 1;
+    #ifdef QSS_MPI
     {
-        // std::cout << "Setting loc_problem" << std::endl;
-        //! Локальный оптимизатор
-        nlopt::opt loc_problem(nlopt::LN_COBYLA, v);
-        loc_problem.set_xtol_abs(_eps);
-        //ПРЕЖДЕ локальный оптимизатор надо конфигурировать ДО того как 
-        //передать его для _копирования_ глобальному. 
-        glob_problem.set_local_optimizer(loc_problem);
+        // MPI вызывается только вне параллельных областей OpenMP
+        int provided;
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+        MPI_Comm_size(MPI_COMM_WORLD, &MPI_size);
+        MPI_Comm_rank(MPI_COMM_WORLD, &MPI_rank);
+    }
+    #endif
+    const bool distributed = MPI_size > 1;
+
+    // Стандартный вывод ведёт только процесс 0
+    if(MPI_rank != 0) std::cout.setstate(std::ios_base::badbit);
+
+    //! Способ вычисления матрицы амплитуд (-e paths|transfer|tape|static)
+    graph::engines_types engine = graph::pathEnumeration;
+    //! Локальный оптимизатор (-a cobyla|lbfgs|slsqp|mma)
+    nlopt::algorithm local = nlopt::LN_COBYLA;
+    //! Графов на процесс за раунд между обменами best_dev (-r)
+    size_t roundSize = 1000;
+    //! Сколько лучших графов собирается на процессе 0 (-k)
+    size_t topSize = 10;
+    //! Начальных точек на граф (-m) и запусков NLopt из лучших из них (-n), см. multistart()
+    uint starts = 1, runs = 4;
+    //! Порог досрочной остановки запусков NLopt: best*ratio + slack (-c ratio, например 1.2; -C slack).
+    //! По умолчанию выключен (0): с ним результаты отличаются от запусков на всё отведённое время
+    double cutoffRatio = 0, cutoffSlack = 0.05;
+    //! Время запуска NLopt на ступенях отбора, с (-L, через запятую). Пусто - без отбора
+    vector<double> ladder;
+    //! Доля графов, переходящих на следующую ступень (-f)
+    double fraction = 0.25;
+    //! Оптимизировать один граф на класс символьной структуры (-u)
+    bool unique = false;
+    //! Файл для строк телеметрии (-j), пусто - стандартный поток ошибок
+    string telemetryName;
+    //! Период строк телеметрии, с (-p), 0 - без телеметрии
+    double telemetryInterval = 10;
+    {
+        int opt;
+        while((opt = getopt(argc, argv, "e:a:r:k:m:n:c:C:L:f:uj:p:")) != -1)
+        switch(opt)
+        {
+            case 'j': telemetryName = optarg; break;
+            case 'p': telemetryInterval = stod(string(optarg)); break;
+            case 'u': unique = true; break;
+            case 'L':
+            {
+                ladder.clear();
+                stringstream list(optarg);
+                string t;
+                while(getline(list, t, ','))
+                ladder.push_back(stod(t));
+                break;
+            }
+            case 'f': fraction = min(max(stod(string(optarg)), 0.), 1.); break;
+            case 'c': cutoffRatio = stod(string(optarg)); break;
+            case 'C': cutoffSlack = stod(string(optarg)); break;
+            case 'm': starts = stoi(string(optarg)); break;
+            case 'n': runs = stoi(string(optarg)); break;
+            case 'r': roundSize = max(stoul(string(optarg)), 1ul); break;
+            case 'k': topSize = stoul(string(optarg)); break;
+            case 'e':
+                if(!parse_engine(optarg, engine))
+                {
+                    cerr << "Unknown engine: " << optarg << endl;
+                    return 3;
+                }
+                break;
+            case 'a':
+                if(!parse_local(optarg, local))
+                {
+                    cerr << "Unknown local algorithm: " << optarg << endl;
+                    return 3;
+                }
+                break;
+            default: return 3;
+        }
     }
 
-    double result;
-    std::vector<double> grad(v);
-    std::vector<double> x(v, 0.5);
-
-    glob_problem.set_maxtime(1e-2);
-    // std::cout << "Optimizing..." << std::endl;
-    nlopt::result res = glob_problem.optimize(x, result);
-}
-
-bool compare_graph (graph &_a, graph &_b) { return (_a.get_deviation() < _b.get_deviation()); }
-
-double target_function(const std::vector<double> &x, std::vector<double> &grad, void * data)
-{
-    graph *g = reinterpret_cast<graph *>(data);
-
-    g->set_variables(x);
-    
-    double ret = g->get_deviation();
-    // std::cout << "\tDeviation = " << ret << std::endl;
-    return ret;
-}
-
-int main(int argc, char ** argv)
-{
-    using namespace std;
-
-    if(argc == 1)
+    if(optind >= argc)
     {
         cerr << "Enter file name with graphs" << endl;
         return 1;
     }
-    
-    ifstream gfile(argv[1]);
-    if(!gfile.is_open())
+
+    telemetry &tm = global_telemetry();
+    if(telemetryInterval > 0)
     {
-        cerr << "Cannot open file" << endl;
-        return 2;
+        const string name = (distributed && !telemetryName.empty()) ? telemetryName + "." + to_string(MPI_rank) : telemetryName;
+        if(!tm.start("optimizer", MPI_rank, name, telemetryInterval))
+        {
+            cerr << "Cannot open file " << name << endl;
+            return 2;
+        }
     }
+    tm.phase("read");
     
-    size_t numGraphs = 0;
+    //! Бинарные списки графов (см. graphfile.hpp) читаются через mmap без блокировок.
+    //! Несколько файлов (например, от sifter_mpi) оптимизируются как один список.
+    vector<unique_ptr<graph_reader> > bins;
+    //! Номер первого графа каждого файла в общем списке
+    vector<size_t> binFirst;
+    for(int a = optind; a < argc; ++a)
     {
-        std::string line;
+        bins.emplace_back(new graph_reader);
+        if(!bins.back()->open(argv[a]))
+        {
+            bins.pop_back();
+            break;
+        }
+    }
+    const bool binary = !bins.empty();
 
-        while (std::getline(gfile, line))
-            ++numGraphs;
+    if(binary && bins.size() != size_t(argc - optind))
+    {
+        cerr << "Cannot open binary file " << argv[optind + bins.size()] << endl;
+        return 2;
+    }
 
-        gfile.clear(ios_base::eofbit);
-        gfile.seekg(0);
+    if(!binary)
+    {
+        // Файл с сигнатурой QSSG, который graph_reader не принял, - повреждённый бинарный, а не текст
+        ifstream probe(argv[optind], ios_base::binary);
+        char magic[4];
+        if(probe.read(magic, 4) && string(magic, 4) == "QSSG")
+        {
+            cerr << "Corrupt binary file " << argv[optind] << endl;
+            return 2;
+        }
     }
 
+    ifstream gfile;
+    size_t numGraphs = 0;
     uint p, bs, dc, w;
+    graph::cmatrix_t targetMatrix;
+
+    if(binary)
     {
-        string str;
-        gfile >> str;
-        p = stoi(str);
-        gfile >> str;
-        bs = stoi(str);
-        gfile >> str;
-        dc = stoi(str);
-        gfile >> str;
-        w = stoi(str);
+        const graph_reader &bin = *bins.front();
+        p = bin.p();
+        bs = bin.bs();
+        dc = bin.dc();
+        w = bin.w();
+        for(auto &b : bins)
+        if(b->p() != p || b->bs() != bs || b->dc() != dc || b->w() != w)
+        {
+            cerr << "Binary files have different graph sizes" << endl;
+            return 2;
+        }
 
         cout << p << '\t' << bs << '\t' << dc << '\t' << w << endl;
-        
-        --numGraphs;
-    }
-    const uint gSize = p + 2*(bs+dc+w);
 
-    graph::cmatrix_t targetMatrix(p, std::vector<std::complex<double> >(p));
-    {
+        targetMatrix = bin.target_matrix();
         for(size_t i = 0; i < p; ++i)
         {
             for(size_t j = 0; j < p; ++j)
+            cout << targetMatrix[i][j] << '\t';
+            cout << endl;
+        }
+
+        for(auto &b : bins)
+        {
+            binFirst.push_back(numGraphs);
+            numGraphs += b->size();
+        }
+    }
+    else
+    {
+        gfile.open(argv[optind]);
+        if(!gfile.is_open())
+        {
+            cerr << "Cannot open file" << endl;
+            return 2;
+        }
+
+        {
+            std::string line;
+
+            while (std::getline(gfile, line))
+                ++numGraphs;
+
+            gfile.clear(ios_base::eofbit);
+            gfile.seekg(0);
+        }
+
+        {
+            string str;
+            gfile >> str;
+            p = stoi(str);
+            gfile >> str;
+            bs = stoi(str);
+            gfile >> str;
+            dc = stoi(str);
+            gfile >> str;
+            w = stoi(str);
+
+            cout << p << '\t' << bs << '\t' << dc << '\t' << w << endl;
+        
+            --numGraphs;
+        }
+        targetMatrix.assign(p, std::vector<std::complex<double> >(p));
+        {
+            for(size_t i = 0; i < p; ++i)
             {
-                gfile >> targetMatrix[i][j];
-                cout << targetMatrix[i][j] << '\t';
+                for(size_t j = 0; j < p; ++j)
+                {
+                    gfile >> targetMatrix[i][j];
+                    cout << targetMatrix[i][j] << '\t';
+                }
+                cout << endl;
             }
-            cout << endl;
+
+            numGraphs -= p;
         }
 
-        numGraphs -= p;
+        // Последняя строка текстового файла не читается как граф
+        --numGraphs;
+    }
+    const uint gSize = p + 2*(bs+dc+w);
+
+    if(!binary)
+    {
+        // Текстовый файл читается по порядку: графы процесса - MPI_rank, MPI_rank + size, ...
+        // Первые MPI_rank графов пропускаются здесь, дальше read_edges() после
+        // каждого графа пропускает графы остальных процессов
+        uint skip;
+        for(uint i = 0; i < gSize * MPI_rank; ++i)
+        gfile >> skip;
     }
 
+    if(engine == graph::staticKernel && !static_graph_supported(p, bs + dc + w) && MPI_rank == 0)
+    cerr << "static_graph is not built for this size, using transfer" << endl;
+
     vector<graph> best;
 
     double best_dev = __DBL_MAX__;
 
-    #pragma omp parallel for schedule(guided)
-    for(size_t i = 0; i < numGraphs - 1; ++i)
+    //! Лучшее отклонение для досрочной остановки публикуется атомарно, без critical(best)
+    cutoff_t cutoff(cutoffRatio, cutoffSlack);
+    cutoff_t *const cut = (cutoffRatio > 0) ? &cutoff : NULL;
+
+    //! Лучшие графы процесса по возрастанию отклонения, не больше topSize
+    vector<pair<double, graph> > top;
+
+    //! Графы этого процесса: MPI_rank + k*MPI_size, k < mine
+    const size_t mine = numGraphs / MPI_size + (size_t(MPI_rank) < numGraphs % MPI_size);
+    //! Рёбра графов процесса из текстового файла, если они читаются заранее (-u)
+    vector<uint> textEdges;
+
+    auto new_graph = [&]()
     {
-        // cout << "Graph #" << i << endl;
         graph g(p, bs, dc, w);
-        vector<uint> edges(p+2*(bs+dc+w));
+        g.set_engine(engine);
         g.set_target_matrix(targetMatrix);
+        return g;
+    };
+
+    //! Читает рёбра i-го графа общего списка
+    auto read_edges = [&](size_t i, vector<uint> &edges)
+    {
+        edges.resize(gSize);
 
+        if(binary)
+        {
+            const size_t f = upper_bound(binFirst.begin(), binFirst.end(), i) - binFirst.begin() - 1;
+            bins[f]->get(i - binFirst[f], edges);
+        }
+        else if(!textEdges.empty())
+        {
+            const uint *e = &textEdges[(i - MPI_rank) / MPI_size * gSize];
+            copy(e, e + gSize, edges.begin());
+        }
+        else
         #pragma omp critical(graphs)
         {
             for(uint i = 0; i < gSize; ++i)
             gfile >> edges[i];
+
+            // Графы остальных процессов пропускаются
+            uint skip;
+            for(uint i = 0; i < gSize * (MPI_size - 1); ++i)
+            gfile >> skip;
         }
+    };
 
-        g.set_edges(edges);
-        NLopt(g, 1e-2);
+    //! Представители классов (их k) в порядке появления
+    vector<size_t> reps;
+    //! Остальные графы класса u: members[memberFirst[u] .. memberFirst[u + 1])
+    vector<size_t> memberFirst, members;
+
+    if(unique)
+    {
+        tm.phase("classes");
+        TRACE_SCOPE("structure_classes");
+
+        // Текстовый файл читается по порядку, поэтому при разбиении он загружается целиком
+        if(!binary)
+        {
+            vector<uint> all(mine * gSize), edges;
+            for(size_t k = 0; k < mine; ++k)
+            {
+                read_edges(MPI_rank + k*MPI_size, edges);
+                copy(edges.begin(), edges.end(), all.begin() + k*gSize);
+            }
+            textEdges.swap(all);
+        }
+
+        vector<size_t> repOf(mine);
+        unordered_map<string, size_t> classes;
+
+        // Ключи считаются параллельно блоками, чтобы не держать в памяти ключи всех графов
+        const size_t block = 4096;
+        vector<string> keys;
+        for(size_t b = 0; b < mine; b += block)
+        {
+            const size_t e = min(mine, b + block);
+            keys.assign(e - b, string());
+
+            #pragma omp parallel for schedule(guided)
+            for(size_t k = b; k < e; ++k)
+            {
+                vector<uint> edges, label;
+                read_edges(MPI_rank + k*MPI_size, edges);
+
+                // transferMatrix не строит траектории в set_edges(), ключу они не нужны
+                graph g(p, bs, dc, w);
+                g.set_engine(graph::transferMatrix);
+                g.set_edges(edges);
+                keys[k - b] = g.structure_key(label);
+            }
+
+            for(size_t k = b; k < e; ++k)
+            {
+                auto ins = classes.emplace(move(keys[k - b]), reps.size());
+                if(ins.second) reps.push_back(k);
+                repOf[k] = ins.first->second;
+            }
+        }
+
+        memberFirst.assign(reps.size() + 1, 0);
+        for(size_t k = 0; k < mine; ++k)
+        if(reps[repOf[k]] != k) ++memberFirst[repOf[k] + 1];
+
+        for(size_t u = 0; u < reps.size(); ++u)
+        memberFirst[u + 1] += memberFirst[u];
+
+        members.resize(memberFirst.back());
+        vector<size_t> fill(memberFirst.begin(), memberFirst.end() - 1);
+        for(size_t k = 0; k < mine; ++k)
+        if(reps[repOf[k]] != k) members[fill[repOf[k]]++] = k;
+
+        size_t total[2] = {reps.size(), mine};
+        #ifdef QSS_MPI
+        MPI_Allreduce(MPI_IN_PLACE, total, 2, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+        #endif
+        if(MPI_rank == 0)
+        cerr << "Structure classes: " << total[0] << " of " << total[1] << " graphs" << endl;
+    }
+
+    //! Графов к оптимизации на этом процессе и наибольшее их число среди процессов
+    const size_t todo = unique ? reps.size() : mine;
+    size_t todoMax = todo;
+    #ifdef QSS_MPI
+    MPI_Allreduce(MPI_IN_PLACE, &todoMax, 1, MPI_UNSIGNED_LONG, MPI_MAX, MPI_COMM_WORLD);
+    #endif
+
+    //! Номер в общем списке k-го оптимизируемого графа процесса
+    auto index = [&](size_t k) { return MPI_rank + (unique ? reps[k] : k)*MPI_size; };
+
+    //! Число раундов одинаково у всех процессов, иначе MPI_Allreduce не сойдётся.
+    //! Отбор идёт внутри раунда, поэтому с лестницей бюджетов раунды нужны и без MPI.
+    const size_t perRound = (distributed || !ladder.empty()) ? roundSize : max<size_t>(todo, 1);
+    const size_t rounds = (todoMax + perRound - 1) / perRound;
+
+    //! Если графов меньше, чем потоков, параллельно идут запуски multistart() внутри графа
+    const bool graphsParallel = starts <= 1 || todo >= size_t(omp_get_max_threads());
+
+    //! Учитывает полностью оптимизированный граф в best_dev, best и top
+    auto accept = [&](size_t i, graph &g)
+    {
         const double dev = g.get_deviation();
+        cutoff.publish(dev);
+        tm.add(telemetry::graphsOptimized);
 
         #pragma omp critical(best)
         {
             if(dev < best_dev) 
             {
                 best_dev = dev;
-                cout << endl << "best.size() = " << best.size() << endl;
-                cout << "Graph #" << i << " deviation: " << dev << endl;
-                best.push_back(g);
+                // Распределённый запуск печатает только итоговые лучшие графы на процессе 0
+                if(!distributed)
+                {
+                    cout << endl << "best.size() = " << best.size() << endl;
+                    cout << "Graph #" << i << " deviation: " << dev << endl;
+                    best.push_back(g);
 
-                cout << "Edges:" << endl;
-                for(auto j : best.back().get_edges())
-                cout << j << '\t';
-                cout << endl;
-    
-                cout << "Variables:" << endl << '\t';
-                for(auto j : best.back().get_variables())
-                cout << j << '\t';
-                cout << endl;
+                    print_graph(best.back());
+                }
+            }
 
-                cout << "\tMatrix amplitude:" << endl;
-                graph::cmatrix_t MAmp = best.back().get_matrix_amplitude();
-                for(size_t i = 0; i < p; ++i)
+            if(distributed && (top.size() < topSize || (!top.empty() && dev < top.back().first)))
+            {
+                top.insert(upper_bound(top.begin(), top.end(), dev, 
+                    [](double _d, const pair<double, graph> &_t) { return _d < _t.first; }), 
+                    make_pair(dev, g));
+                if(top.size() > topSize) top.pop_back();
+            }
+        }
+    };
+
+    //! Раздаёт переменные оптимизированного графа k остальным графам его класса
+    auto fan_out = [&](size_t k, graph &g)
+    {
+        if(!unique) return;
+
+        vector<uint> label, edges;
+        g.structure_key(label);
+        const vector<double> x = g.relabel_variables(g.get_variables(), label);
+
+        for(size_t m = memberFirst[k]; m < memberFirst[k + 1]; ++m)
+        {
+            const size_t i = MPI_rank + members[m]*MPI_size;
+            read_edges(i, edges);
+
+            graph h = new_graph();
+            h.set_edges(edges);
+            h.structure_key(label);
+            h.set_variables(h.relabel_variables(x, label, true));
+            accept(i, h);
+        }
+    };
+
+    //! Граф на ступени отбора
+    struct candidate_t
+    {
+        size_t k;           //!< Номер среди оптимизируемых графов процесса
+        vector<uint> edges;
+        vector<double> x;   //!< Переменные после предыдущей ступени
+        double dev;
+    };
+
+    tm.phase("optimize");
+    tm.set_work(todo);
+
+    for(size_t r = 0; r < rounds; ++r)
+    {
+        // Графов процесса может не хватить на все раунды (неравные доли, -u): тогда
+        // from == to и раунд пропускается, но в обмене best_dev процесс участвует
+        const size_t from = min(todo, r * perRound), to = min(todo, from + perRound);
+
+        if(ladder.empty())
+        {
+            #pragma omp parallel for schedule(guided) if(graphsParallel)
+            for(size_t k = from; k < to; ++k)
+            {
+                const size_t i = index(k);
+                TRACE_SCOPE("graph");
+
+                // cout << "Graph #" << i << endl;
+                graph g = new_graph();
+                vector<uint> edges;
+                read_edges(i, edges);
+
+                g.set_edges(edges);
+                if(starts > 1)
+                multistart(g, 1e-2, local, starts, runs, i, cut);
+                else
+                NLopt(g, 1e-2, local, vector<double>(), cut);
+
+                accept(i, g);
+                fan_out(k, g);
+                tm.work_done();
+            }
+        }
+        else
+        if(from < to)
+        {
+            vector<candidate_t> pool(to - from);
+
+            for(size_t s = 0; s <= ladder.size(); ++s)
+            {
+                const bool last = s == ladder.size();
+
+                if(s > 0)
                 {
-                    cout << "\t\t";
-                    for(size_t j = 0; j < p; ++j)
-                    cout << MAmp[i][j] << '\t';
-    
-                    cout << endl;
+                    // Дальше идёт лучшая доля графов, но хотя бы один и не больше, чем есть
+                    const size_t keep = min<size_t>(pool.size(), max<size_t>(1, ceil(pool.size() * fraction)));
+                    nth_element(pool.begin(), pool.begin() + (keep - 1), pool.end(),
+                        [](const candidate_t &_a, const candidate_t &_b) { return _a.dev < _b.dev; });
+                    pool.resize(keep);
                 }
-    
-                cout << "\tMatrix truth:" << endl;
-                graph::cmatrix_t MTruth = best.back().get_matrix_truth();
-                for(size_t i = 0; i < p; ++i)
+
+                // Время запусков на ступени одинаково, но время сходимости разное
+                #pragma omp parallel for schedule(dynamic) if(graphsParallel)
+                for(size_t c = 0; c < pool.size(); ++c)
                 {
-                    cout << "\t\t";
-                    for(size_t j = 0; j < p; ++j)
-                    cout << MTruth[i][j] << '\t';
-    
-                    cout << endl;
+                    candidate_t &cand = pool[c];
+                    TRACE_SCOPE("candidate");
+
+                    if(s == 0)
+                    {
+                        cand.k = from + c;
+                        read_edges(index(cand.k), cand.edges);
+                    }
+
+                    graph g = new_graph();
+                    g.set_edges(cand.edges);
+
+                    if(last)
+                    {
+                        NLopt(g, 1e-2, local, cand.x, cut);
+                        accept(index(cand.k), g);
+                        fan_out(cand.k, g);
+                        continue;
+                    }
+
+                    // Порог досрочной остановки рассчитан на полный запуск, на ступенях отбора он не нужен
+                    if(s == 0 && starts > 1)
+                    multistart(g, 1e-2, local, starts, runs, index(cand.k), NULL, ladder[s]);
+                    else
+                    NLopt(g, 1e-2, local, cand.x, NULL, ladder[s]);
+
+                    cand.x = g.get_variables();
+                    cand.dev = g.get_deviation();
+                    // Достигнутое отклонение - честная верхняя оценка для порога
+                    cutoff.publish(cand.dev);
+
+                    if(s == 0) tm.work_done();
                 }
             }
         }
 
-        #pragma omp critical(stderr)
+        #ifdef QSS_MPI
+        // Лучшее отклонение всех процессов становится порогом для следующего раунда
+        TRACE_SCOPE("allreduce");
+        MPI_Allreduce(MPI_IN_PLACE, &best_dev, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+        cutoff.publish(best_dev);
+        if(MPI_rank == 0 && distributed)
+        cerr << "Round " << r + 1 << '/' << rounds << ", best deviation: " << best_dev << endl;
+        #endif
+    }
+
+    tm.phase("gather");
+
+    if(cut != NULL)
+    cerr << "Aborted runs: " << cutoff.aborted << endl;
+
+    #ifdef QSS_MPI
+    if(distributed)
+    {
+        TRACE_SCOPE("gather");
+
+        // Запись: отклонение, рёбра, переменные. Недостающие записи - с отклонением __DBL_MAX__.
+        const size_t vars = graph(p, bs, dc, w).get_variables().size();
+        const size_t rec = 1 + gSize + vars;
+
+        vector<double> local(topSize * rec, __DBL_MAX__);
+        for(size_t t = 0; t < top.size(); ++t)
+        {
+            double *r = &local[t * rec];
+            r[0] = top[t].first;
+            const vector<uint> e = top[t].second.get_edges();
+            copy(e.begin(), e.end(), r + 1);
+            const vector<double> x = top[t].second.get_variables();
+            copy(x.begin(), x.end(), r + 1 + gSize);
+        }
+
+        vector<double> all(MPI_rank == 0 ? local.size() * MPI_size : 0);
+        MPI_Gather(local.data(), local.size(), MPI_DOUBLE, all.data(), local.size(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+        if(MPI_rank == 0)
         {
-            static uint toShow = 50;
-            static uint processed = 0;
-            if(++processed % (numGraphs/toShow) == 0)
-            cerr << round(100 * float(processed) / numGraphs) << "% graphs" << endl;
+            vector<size_t> order;
+            for(size_t t = 0; t < topSize * MPI_size; ++t)
+            if(all[t * rec] != __DBL_MAX__) order.push_back(t);
+
+            sort(order.begin(), order.end(), [&](size_t _a, size_t _b) { return all[_a * rec] < all[_b * rec]; });
+            if(order.size() > topSize) order.resize(topSize);
+
+            for(size_t n = 0; n < order.size(); ++n)
+            {
+                const double *r = &all[order[n] * rec];
+
+                graph g(p, bs, dc, w);
+                g.set_engine(engine);
+                g.set_target_matrix(targetMatrix);
+                g.set_edges(vector<uint>(r + 1, r + 1 + gSize));
+                g.set_variables(vector<double>(r + 1 + gSize, r + rec));
+
+                cout << endl << "Top #" << n << " deviation: " << r[0] << endl;
+                print_graph(g);
+            }
         }
     }
+    #endif
+
+    tm.stop();
+
+    #if QSS_TRACE >= 1
+    {
+        // Файл трассировки: QSS_TRACE_FILE или optimizer.trace.json, у процессов MPI - с номером процесса
+        const char *env = getenv("QSS_TRACE_FILE");
+        const string name = string(env != NULL ? env : "optimizer.trace.json") + (distributed ? "." + to_string(MPI_rank) : "");
+        if(!TRACE_DUMP(name, MPI_rank))
+        cerr << "Cannot write " << name << endl;
+    }
+    #endif
+
+    #ifdef QSS_MPI
+    MPI_Finalize();
+    #endif
 
     // // Графы упорядочены по убыванию deviation
     // // Необходимо обратить этот порядок
@@ -0,0 +1,162 @@
+#ifndef OUTPUT_CPP
+#define OUTPUT_CPP
+
+#include <errno.h>
+#include <unistd.h>
+#include <chrono>
+#include <algorithm>
+
+#include <omp.h>
+
+#include "output.hpp"
+#include "trace.hpp"
+
+buffered_output::buffered_output(uint _slots) :
+	slots(std::max(_slots, 1u)),
+	// Буферов в очереди на запись вдвое больше, чем потоков: пока один пишется, потоки не ждут
+	full(2 * slots.size()),
+	// Сюда помещаются все буферы: по одному у потоков, полная очередь и буфер в записи
+	spare(3 * slots.size() + 1)
+{
+	for(auto &s : slots)
+	{
+		s.busy.clear();
+		s.buffer = new buffer_t;
+		s.buffer->reserve(OUTPUT_BUFFER_SIZE);
+	}
+
+	submitted = 0;
+	written.store(0);
+	fd = -1;
+	stopping.store(false);
+	error.store(false);
+}
+
+buffered_output::~buffered_output()
+{
+	close();
+
+	for(auto &s : slots)
+	delete s.buffer;
+
+	buffer_t *b;
+	while(spare.try_pop(b))
+	delete b;
+}
+
+void buffered_output::start(int _fd)
+{
+	fd = _fd;
+	stopping.store(false);
+	writer = std::thread(&buffered_output::run, this);
+}
+
+void buffered_output::lock(slot_t &_s)
+{
+	while(_s.busy.test_and_set(std::memory_order_acquire))
+	std::this_thread::yield();
+}
+
+void buffered_output::write(const void *_data, size_t _n)
+{
+	slot_t &s = slots[omp_get_thread_num() % slots.size()];
+	lock(s);
+
+	if(s.buffer->size() + _n > OUTPUT_BUFFER_SIZE && !s.buffer->empty())
+	hand_over(s);
+
+	const char *c = static_cast<const char *>(_data);
+	s.buffer->insert(s.buffer->end(), c, c + _n);
+
+	unlock(s);
+}
+
+u_int64_t buffered_output::hand_over(slot_t &_s)
+{
+	u_int64_t ticket;
+	{
+		// Номер берётся вместе с постановкой в очередь: буфер с номером k
+		// записывается k-м, и все буферы до него уже посчитаны в submitted
+		std::lock_guard<std::mutex> guard(push_lock);
+		while(!full.try_push(_s.buffer))
+		std::this_thread::yield();
+		ticket = ++submitted;
+	}
+
+	if(!spare.try_pop(_s.buffer))
+	{
+		_s.buffer = new buffer_t;
+		_s.buffer->reserve(OUTPUT_BUFFER_SIZE);
+	}
+
+	return ticket;
+}
+
+void buffered_output::flush()
+{
+	TRACE_SCOPE("flush");
+
+	// Очередь с одним читателем пишется по порядку: после target-го буфера
+	// записаны и все отданные до него. Сначала это буферы, уже отданные другими потоками
+	u_int64_t target;
+	{
+		std::lock_guard<std::mutex> guard(push_lock);
+		target = submitted;
+	}
+
+	for(auto &s : slots)
+	{
+		lock(s);
+		if(!s.buffer->empty()) target = std::max(target, hand_over(s));
+		unlock(s);
+	}
+
+	while(written.load() < target)
+	std::this_thread::yield();
+}
+
+void buffered_output::close()
+{
+	if(!writer.joinable()) return;
+
+	flush();
+	stopping.store(true);
+	writer.join();
+}
+
+void buffered_output::run()
+{
+	while(true)
+	{
+		buffer_t *b;
+		if(!full.try_pop(b))
+		{
+			if(stopping.load()) break;
+
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		{
+			TRACE_SCOPE("write");
+
+			for(size_t done = 0; done < b->size();)
+			{
+				const ssize_t n = ::write(fd, b->data() + done, b->size() - done);
+				if(n < 0 && errno == EINTR) continue;
+				if(n <= 0)
+				{
+					error.store(true);
+					break;
+				}
+				done += n;
+			}
+		}
+
+		b->clear();
+		if(!spare.try_push(b)) delete b;
+		written.fetch_add(1);
+	}
+}
+
+#endif //! OUTPUT_CPP
@@ -0,0 +1,86 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <stdlib.h>
+
+#include "queue.hpp"
+
+//! Размер буфера потока, байт
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/*
+ * @brief Вывод из многих потоков через отдельный поток записи.
+ *  Каждый поток OpenMP дописывает данные в свой буфер. Заполненный буфер
+ *  уходит в очередь (bounded_queue), а поток записи отдаёт его в файл одним
+ *  большим write() и возвращает пустым в очередь свободных буферов.
+ *  Порядок записей разных потоков не сохраняется, записи одного потока
+ *  не перемежаются с чужими.
+ *
+ *  Буфер потока защищён своим флагом занятости: в обычной работе его берёт
+ *  только свой поток, flush() из другого потока забирает неполные буферы всех потоков.
+ *  Когда очередь полна, пишущие потоки ждут (обратное давление).
+ */
+class buffered_output {
+public:
+	//! @param _slots	Число пишущих потоков (omp_get_num_threads())
+	explicit buffered_output(uint _slots);
+	~buffered_output();
+
+	//! Запускает поток записи в дескриптор _fd
+	void start(int _fd);
+
+	//! Дописывает _n байт в буфер текущего потока
+	void write(const void *_data, size_t _n);
+
+	//! Отдаёт в запись неполные буферы всех потоков и ждёт, пока всё выведенное до вызова будет записано
+	void flush();
+
+	//! flush() и остановка потока записи
+	void close();
+
+	//! true, если какой-то write() завершился ошибкой
+	bool failed() const { return error.load(); }
+
+protected:
+	typedef std::vector<char> buffer_t;
+
+	//! Буфер потока, на своей линии кэша
+	struct alignas(64) slot_t
+	{
+		std::atomic_flag busy;
+		buffer_t *buffer;
+	};
+
+	void lock(slot_t &_s);
+	void unlock(slot_t &_s) { _s.busy.clear(std::memory_order_release); }
+
+	/*
+	 * @brief Отдаёт буфер ячейки в запись и ставит на его место пустой. Вызывается под lock()
+	 * 
+	 * @return Номер отданного буфера: он записан, когда written >= номера
+	 */
+	u_int64_t hand_over(slot_t &_s);
+
+	//! Цикл потока записи
+	void run();
+
+	std::vector<slot_t> slots;
+
+	bounded_queue<buffer_t *> full;		//!< Буферы в очереди на запись
+	bounded_queue<buffer_t *> spare;	//!< Свободные буферы
+
+	std::mutex push_lock;				//!< Постановка в full вместе с номером из submitted
+	u_int64_t submitted;				//!< Буферов отдано в запись, под push_lock
+	std::atomic<u_int64_t> written;		//!< Буферов записано
+
+	int fd;
+	std::thread writer;
+	std::atomic<bool> stopping;
+	std::atomic<bool> error;
+};
+
+#endif //! OUTPUT_HPP
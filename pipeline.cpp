@@ -0,0 +1,266 @@
+/*
+ * Сифтер и оптимизатор в одном процессе.
+ * 
+ * Часть потоков перебирает заготовки графов так же, как sifter, и кладёт
+ * просеянные графы в ограниченную неблокирующую очередь. Остальные потоки
+ * достают графы из очереди и сразу оптимизируют их, как optimizer.
+ * Когда очередь полна, сифтеры ждут (обратное давление), поэтому
+ * промежуточный список графов нигде не хранится.
+ * 
+ * Аргументы: [опции] p bs dc w <матрица просеивания p*p>
+ *  -t файл     целевая матрица, p*p комплексных чисел "(re,im)" (обязательно)
+ *  -S n        число потоков сифтера (по умолчанию половина потоков OpenMP)
+ *  -Q n        ёмкость очереди (по умолчанию 65536 графов)
+ *  -e, -a      способ вычисления и локальный оптимизатор, как у optimizer
+ *  -s          только канонические графы, как у sifter
+ * 
+ * На стандартный вывод печатаются улучшения лучшего графа, в поток ошибок - прогресс.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <omp.h>
+
+#include "graph.hpp"
+#include "enumerator.hpp"
+#include "optimize.hpp"
+#include "queue.hpp"
+
+//! Граф в очереди: рёбра по байту на узел (узлов не больше 64)
+struct record_t
+{
+    unsigned char e[64];
+};
+
+int main(int argc, char ** argv)
+{
+    using namespace std;
+
+    graph::engines_types engine = graph::pathEnumeration;
+    nlopt::algorithm local = nlopt::LN_COBYLA;
+    bool symmetry = false;
+    string targetName;
+    int siftThreads = 0;
+    size_t capacity = 1 << 16;
+    {
+        int opt;
+        while((opt = getopt(argc, argv, "e:a:st:S:Q:")) != -1)
+        switch(opt)
+        {
+            case 'e':
+                if(!parse_engine(optarg, engine))
+                {
+                    cerr << "Unknown engine: " << optarg << endl;
+                    return 4;
+                }
+                break;
+            case 'a':
+                if(!parse_local(optarg, local))
+                {
+                    cerr << "Unknown local algorithm: " << optarg << endl;
+                    return 4;
+                }
+                break;
+            case 's': symmetry = true; break;
+            case 't': targetName = optarg; break;
+            case 'S': siftThreads = stoi(string(optarg)); break;
+            case 'Q': capacity = stoul(string(optarg)); break;
+            default: return 4;
+        }
+
+        argv += optind - 1;
+        argc -= optind - 1;
+    }
+
+    if(argc < 5)
+    {
+        cerr << "Not enough arguments" << endl;
+        return 1;
+    }
+
+    const uint p = stoi(string(argv[1]));
+    const uint bs = stoi(string(argv[2]));
+    const uint dc = stoi(string(argv[3]));
+    const uint w = stoi(string(argv[4]));
+    const uint gSize = p + 2*(bs+dc+w);
+
+    if(gSize > 64)
+    {
+        cerr << "More than 64 graph nodes" << endl;
+        return 5;
+    }
+
+    if(argc < 5 + int(p*p))
+    {
+        cerr << "Sift matrix is incomplete" << endl;
+        return 3;
+    }
+
+    //! Матрица для просеивания, в том же порядке, что и у sifter
+    graph::smatrix_t sM(p, vector<bool>(p));
+    for(size_t row = 0; row < p; row++)
+    for(size_t col = 0; col < p; col++)
+        sM[col][row] = bool(stoi(string(argv[5 + row*p + col])));
+
+    graph::cmatrix_t targetMatrix(p, vector<complex<double> >(p));
+    {
+        ifstream tfile(targetName);
+        for(size_t i = 0; i < p; ++i)
+        for(size_t j = 0; j < p; ++j)
+        tfile >> targetMatrix[i][j];
+
+        if(targetName.empty() || !tfile)
+        {
+            cerr << "Cannot read target matrix (-t)" << endl;
+            return 2;
+        }
+    }
+
+    // Нужен хотя бы один поток на каждую стадию
+    const int threads = max(2, omp_get_max_threads());
+    if(siftThreads <= 0) siftThreads = threads / 2;
+    siftThreads = min(siftThreads, threads - 1);
+
+    // Без динамической подстройки команда меньше запрошенной только из-за ограничений среды
+    omp_set_dynamic(0);
+    if(omp_get_thread_limit() < 2)
+    {
+        cerr << "At least two threads are needed, OMP_THREAD_LIMIT is " << omp_get_thread_limit() << endl;
+        return 6;
+    }
+
+    vector<vector<uint> > templates;
+    const uint startPort = make_templates(p, 2*(bs+dc+w), 10 * siftThreads, templates);
+    const vector<vector<uint> > perms = symmetry ? make_symmetries(bs, dc, w) : vector<vector<uint> >();
+
+    bounded_queue<record_t> queue(capacity);
+
+    size_t nextTemplate = 0;
+    atomic<int> siftersDone(0);
+    atomic<u_int64_t> optimized(0);
+    u_int64_t generated = 0, sifted = 0;
+
+    vector<graph> best;
+    double best_dev = __DBL_MAX__;
+
+    //! Потоков сифтера в команде, которая реально запущена
+    int sifters = 0;
+
+    #pragma omp parallel num_threads(threads)
+    {
+        // Команда может оказаться меньше запрошенной (OMP_THREAD_LIMIT, вложенный параллелизм):
+        // тогда потоки делятся заново, иначе оптимизаторы ждали бы несуществующих сифтеров
+        #pragma omp single
+        {
+            const int team = omp_get_num_threads();
+            sifters = team < 2 ? 0 : min(siftThreads, team - 1);
+
+            cerr << "Templates: " << templates.size() << ", sifter threads: " << sifters 
+                << ", optimizer threads: " << team - sifters << endl;
+        }
+
+        if(omp_get_thread_num() < sifters)
+        {
+            graph g(p, bs, dc, w);
+            g.set_engine(engine);
+
+            enumerator en(p, bs, dc, w);
+            en.set_symmetries(perms);
+
+            const enumerator::visit_t push = [&queue](const vector<uint> &_e)
+            {
+                record_t r;
+                for(size_t i = 0; i < _e.size(); ++i)
+                r.e[i] = _e[i];
+
+                while(!queue.try_push(r))
+                this_thread::yield();
+            };
+
+            while(true)
+            {
+                size_t templ;
+                #pragma omp atomic capture
+                templ = nextTemplate++;
+
+                if(templ >= templates.size()) break;
+
+                en.run(templates[templ], startPort, g, sM, push);
+            }
+
+            #pragma omp atomic
+            generated += en.leaves;
+            #pragma omp atomic
+            sifted += en.sifted;
+
+            siftersDone.fetch_add(1);
+        }
+        else
+        {
+            graph g(p, bs, dc, w);
+            g.set_engine(engine);
+            g.set_target_matrix(targetMatrix);
+
+            vector<uint> edges(gSize);
+            record_t r;
+
+            while(true)
+            {
+                if(!queue.try_pop(r))
+                {
+                    // Все, что сифтеры положили до завершения, уже видно в очереди
+                    if(siftersDone.load() == sifters)
+                    {
+                        if(!queue.try_pop(r)) break;
+                    }
+                    else
+                    {
+                        this_thread::yield();
+                        continue;
+                    }
+                }
+
+                for(size_t i = 0; i < gSize; ++i)
+                edges[i] = r.e[i];
+
+                g.set_edges(edges);
+                NLopt(g, 1e-2, local);
+                const double dev = g.get_deviation();
+                const u_int64_t i = optimized.fetch_add(1);
+
+                #pragma omp critical(best)
+                {
+                    if(dev < best_dev)
+                    {
+                        best_dev = dev;
+                        cout << endl << "best.size() = " << best.size() << endl;
+                        cout << "Graph #" << i << " deviation: " << dev << endl;
+                        best.push_back(g);
+
+                        print_graph(best.back());
+                    }
+                }
+            }
+        }
+    }
+
+
+    if(sifters == 0)
+    {
+        cerr << "Only one thread was started, at least two are needed" << endl;
+        return 6;
+    }
+
+    cerr << "Generated graphs: " << generated << endl;
+    cerr << "Sifted graphs: " << sifted << endl;
+    cerr << "Optimized graphs: " << optimized.load() << endl;
+
+    return 0;
+}
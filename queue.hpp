@@ -0,0 +1,107 @@
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include <atomic>
+#include <memory>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * @brief Ограниченная неблокирующая очередь для многих писателей и многих читателей
+ *  (кольцевой буфер Д. Вьюкова). У каждой ячейки есть счётчик seq: писатель
+ *  захватывает ячейку, если seq == pos, читатель - если seq == pos + 1.
+ *  Полная очередь не растёт: try_push() возвращает false, и писатель сам решает,
+ *  ждать ли ему (обратное давление на производителей).
+ *
+ * @tparam T    Тип элемента. Копируется целиком, поэтому лучше небольшой и без кучи.
+ */
+template<class T>
+class bounded_queue {
+public:
+
+	//! @param _capacity    Ёмкость, округляется вверх до степени двойки
+	explicit bounded_queue(size_t _capacity)
+	{
+		size_t c = 2;
+		while(c < _capacity) c <<= 1;
+
+		mask = c - 1;
+		buffer.reset(new cell_t[c]);
+		for(size_t i = 0; i < c; ++i)
+		buffer[i].seq.store(i, std::memory_order_relaxed);
+
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	//! Кладёт элемент в очередь. false - если очередь полна.
+	bool try_push(const T &_item)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		cell_t *c;
+		while(true)
+		{
+			c = &buffer[pos & mask];
+			const size_t seq = c->seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+			if(diff == 0)
+			{
+				if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+			}
+			else
+			if(diff < 0) return false;
+			else
+			pos = tail.load(std::memory_order_relaxed);
+		}
+
+		c->data = _item;
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! Достаёт элемент из очереди. false - если очередь пуста.
+	bool try_pop(T &_item)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+		cell_t *c;
+		while(true)
+		{
+			c = &buffer[pos & mask];
+			const size_t seq = c->seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+			if(diff == 0)
+			{
+				if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+			}
+			else
+			if(diff < 0) return false;
+			else
+			pos = head.load(std::memory_order_relaxed);
+		}
+
+		_item = c->data;
+		c->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+protected:
+
+	struct cell_t
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	std::unique_ptr<cell_t[]> buffer;
+	size_t mask;
+
+	// Голова и хвост на разных строках кэша, чтобы писатели и читатели не мешали друг другу
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+};
+
+#endif //! QUEUE_HPP
@@ -6,63 +6,174 @@
  * 
  * В процессе своей работы графы, которые пройдут все проверки будут выведены 
  * на стандартный вывод для дальнейшей оптимизации на хостовой системе.
+ * С опцией -o графы вместо этого пишутся в бинарный файл (см. graphfile.hpp).
+ * Потоки копят графы в своих буферах, а пишет их отдельный поток (см. output.hpp),
+ * поэтому порядок графов от запуска к запуску разный.
  * 
- * В стандартный поток ошибок выводится текущий прогресс.
+ * В стандартный поток ошибок (или в файл -j) раз в -p секунд выводится
+ * строка JSON с ходом перебора, см. telemetry.hpp.
+ * 
+ * С опцией -c раз в -i секунд сохраняется контрольная точка - список завершённых
+ * заготовок, и прерванный перебор можно возобновить с неё, дописывая вывод.
+ * Вывод при этом "хотя бы один раз": графы всех заготовок, которые были в работе
+ * в момент прерывания, уже частично выведены и при возобновлении будут выведены
+ * снова, так что повторы нужно убрать при чтении (например, sort -u). На одном
+ * процессе в работе не больше двух заготовок на поток (см. sift_range), а при
+ * запуске на нескольких - диапазоны заготовок, выданные рабочим процессам.
+ * 
+ * В MPI-сборке (QSS_MPI) процесс 0 только раздаёт диапазоны заготовок
+ * остальным процессам по мере их освобождения и ведёт контрольную точку,
+ * а каждый из остальных процессов перебирает полученные заготовки своими
+ * потоками OpenMP и пишет графы в свой бинарный файл <-o>.<номер процесса>.
+ * Процессу 0 почти не нужно ядер, поэтому на первый узел его стоит
+ * запускать сверх числа рабочих процессов.
  * 
  */
 
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
 
 #include <omp.h>
+#ifdef QSS_MPI
+#include <mpi.h>
+#endif
 
 #include "graph.hpp"
+#include "enumerator.hpp"
+#include "graphfile.hpp"
+#include "output.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
 
 #define SIFTER_DEBUG_LOG  0
-u_int64_t   graphs_generated = 0;
 
-//! Находит факториал _top!. Если указан _bot, то вычисляется факториал _top!/_bot!.
-uint fact(const uint _top, const uint _bot = 1);
+//! Поддеревья, где до конца перебора остаётся меньше стольких рёбер, не дробятся
+#define SPLIT_MIN_REST  4
+
+//! Общие данные задач перебора
+struct sift_context_t
+{
+    uint sP;        //!< Первый назначенный в заготовках порт ввода
+    uint last;      //!< Число рёбер, назначаемых перебором
+    uint splitTo;   //!< Поддеревья дробятся, пока назначено меньше стольких рёбер
+    const graph::smatrix_t *sM;
+    const enumerator::visit_t *visit;
+
+    //! Перечислитель и граф каждого потока
+    std::vector<enumerator *> en;
+    std::vector<graph *> g;
+};
 
 /*
- * @brief Генерация заготовок графов
- *  Функция рекусивно создаёт заготовки графов, перебирая все комбинации того,
- *  куда смотрят последние (_i - _p) портов ввода.
+ * @brief Задача перебора поддерева. Верхние уровни дерева дробятся на дочерние
+ *  задачи OpenMP, которые разбирают освободившиеся потоки, а мелкие поддеревья
+ *  перебираются целиком перечислителем текущего потока.
+ */
+void sift_subtree(const sift_context_t *_c, const enumerator::subtree_t &_s);
+
+/*
+ * @brief Атомарно (через временный файл и rename) сохраняет контрольную точку:
+ *  размеры графа, startPort и отметки завершённых заготовок.
+ *  Заготовка отмечается только после того, как все её графы выведены, поэтому
+ *  при возобновлении графы не теряются, но графы всех заготовок, которые были
+ *  в работе в момент прерывания, выводятся повторно (см. начало файла).
+ * 
+ * @param _name     Имя файла контрольной точки
+ * @param _sP       Первый назначенный в заготовках порт ввода
+ * @param _done     По символу на заготовку: 1 - завершена
  * 
- * @param _i        Порт ввода с которого начинаем перебор
- * @param _p        Число портов ввода
- * @param _g        Пустой граф (все узлы "0") с отметкой о занятости входного узла
- * @param answer    Сюда пишется результат
+ * @return false, если файл не удалось записать
  */
-void make_templates_graphs(
-    uint _i,
-    uint _p, 
-    std::vector<std::pair<uint, bool> > _g, 
-    std::vector<std::vector<uint> > &answer);
-
-//Данная рекурсия может получить на входе пустой граф, или его заготовку
-//Возвращает наилучший граф из всех возможных для данной заготовки
-//me - узел, с которого мы сейчас стартуем
-//_e    Заготовка графа
-//_sP   Порт ввода, от которого все последующие порты ввода (включая _sP) инициализированы
-//_fP   Число портов ввода-вывода
-void print_sifted_graphs(
-    uint me, 
-    std::vector<uint> _e, 
-    std::vector<bool> _busy,
-    const uint _sP, 
-    const uint _fP,
-    graph &_g,
-    const graph::smatrix_t &_sM
-);
+bool save_checkpoint(
+    const std::string &_name,
+    uint _p, uint _bs, uint _dc, uint _w,
+    uint _sP,
+    const std::vector<char> &_done);
+
+/*
+ * @brief Читает контрольную точку, сохранённую save_checkpoint()
+ * 
+ * @return false, если файла нет или он сделан для других размеров графа
+ */
+bool load_checkpoint(
+    const std::string &_name,
+    uint _p, uint _bs, uint _dc, uint _w,
+    uint &_sP,
+    std::vector<char> &_done);
 
 int main(int argc, char ** argv)
 {
     using namespace std;
 
+    int MPI_rank = 0, MPI_size = 1;
+    #ifdef QSS_MPI
+    {
+        // MPI вызывается только вне параллельных областей OpenMP
+        int provided;
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+        MPI_Comm_size(MPI_COMM_WORLD, &MPI_size);
+        MPI_Comm_rank(MPI_COMM_WORLD, &MPI_rank);
+    }
+    #endif
+    //! Перебор распределён по процессам MPI: процесс 0 раздаёт заготовки остальным
+    const bool distributed = MPI_size > 1;
+
+    //! Способ вычисления матрицы амплитуд (-e paths|transfer|tape|static)
+    graph::engines_types engine = graph::pathEnumeration;
+    //! Выводить только по одному графу из орбиты перенумераций однотипных операторов (-s)
+    bool symmetry = false;
+    //! Бинарный файл для вывода графов (-o), вместо текста на стандартный вывод
+    string outName;
+    //! Файл с целевой матрицей для заголовка бинарного файла (-t)
+    string targetName;
+    //! Файл контрольной точки (-c). Если он уже есть - перебор возобновляется с него,
+    //! а графы незавершённых к прерыванию заготовок выводятся повторно (см. начало файла)
+    string checkpointName;
+    //! Период сохранения контрольной точки в секундах (-i)
+    double checkpointInterval = 600;
+    //! Сколько верхних рёбер перебора дробить на отдельные задачи (-d)
+    uint splitDepth = 3;
+    //! Файл для строк телеметрии (-j), пусто - стандартный поток ошибок
+    string telemetryName;
+    //! Период строк телеметрии в секундах (-p), 0 - без телеметрии
+    double telemetryInterval = 10;
+    {
+        int opt;
+        while((opt = getopt(argc, argv, "e:so:t:c:i:d:j:p:")) != -1)
+        switch(opt)
+        {
+            case 'j': telemetryName = optarg; break;
+            case 'p': telemetryInterval = stod(string(optarg)); break;
+            case 'd': splitDepth = stoi(string(optarg)); break;
+            case 'c': checkpointName = optarg; break;
+            case 'i': checkpointInterval = stod(string(optarg)); break;
+            case 's': symmetry = true; break;
+            case 'o': outName = optarg; break;
+            case 't': targetName = optarg; break;
+            case 'e':
+                if(string(optarg) == "transfer") engine = graph::transferMatrix; else
+                if(string(optarg) == "paths") engine = graph::pathEnumeration; else
+                if(string(optarg) == "tape") engine = graph::symbolicTape; else
+                if(string(optarg) == "static") engine = graph::staticKernel; else
+                {
+                    cerr << "Неизвестный способ вычисления: " << optarg << endl;
+                    return 4;
+                }
+                break;
+            default: return 4;
+        }
+
+        // Дальше позиционные аргументы разбираются так, будто опций не было
+        argv += optind - 1;
+        argc -= optind - 1;
+    }
+
     if(argc < 5)
     {
         cerr << "Недостаточно аргументов" << endl;
@@ -85,6 +196,12 @@ int main(int argc, char ** argv)
         << "w = " << w << endl;    
     #endif
 
+    if(p + 2*(bs+dc+w) > 64)
+    {
+        cerr << "Узлов графа больше 64" << endl;
+        return 5;
+    }
+
     if(argc == 5)
     {
         cerr << "Матрица не введена" << endl;
@@ -114,6 +231,77 @@ int main(int argc, char ** argv)
     }
     #endif
 
+    //! Целевая матрица: p*p комплексных чисел в формате "(re,im)", как в файле оптимизатора
+    graph::cmatrix_t tM(p, vector<complex<double> >(p));
+    if(!targetName.empty())
+    {
+        ifstream tfile(targetName);
+        for(size_t i = 0; i < p; ++i)
+        for(size_t j = 0; j < p; ++j)
+        tfile >> tM[i][j];
+
+        if(!tfile)
+        {
+            cerr << "Не удалось прочитать целевую матрицу из " << targetName << endl;
+            return 6;
+        }
+    }
+
+    //! Завершённые заготовки (по символу на заготовку) из контрольной точки
+    vector<char> done;
+    uint startPort; //!< Порт ввода
+    // Контрольную точку читает и пишет только процесс 0
+    bool resume = 
+        MPI_rank == 0 &&
+        !checkpointName.empty() && 
+        load_checkpoint(checkpointName, p, bs, dc, w, startPort, done);
+
+    if(resume)
+    cerr << "Возобновление с " << checkpointName << ": завершено " 
+        << count(done.begin(), done.end(), 1) << " из " << done.size() << " заготовок" << endl;
+
+    if(distributed)
+    {
+        if(outName.empty())
+        {
+            if(MPI_rank == 0) cerr << "При запуске на нескольких процессах нужна опция -o" << endl;
+            return 1;
+        }
+
+        outName += "." + to_string(MPI_rank);
+    }
+
+    #ifdef QSS_MPI
+    {
+        int r = resume;
+        MPI_Bcast(&r, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        resume = r;
+    }
+    #endif
+
+    graph_writer writer;
+    // Процесс 0 распределённого перебора графов не пишет. При возобновлении на другом
+    // числе процессов у новых процессов ещё нет файлов - они создаются заново.
+    if(!outName.empty() && !(distributed && MPI_rank == 0) && !(resume && access(outName.c_str(), F_OK) == 0 ? 
+        writer.append(outName, p, bs, dc, w) : 
+        writer.open(outName, p, bs, dc, w, sM, tM)))
+    {
+        cerr << "Не удалось " << (resume ? "открыть для дописывания" : "создать") << " файл " << outName << endl;
+        return 7;
+    }
+
+    telemetry &tm = global_telemetry();
+    if(telemetryInterval > 0)
+    {
+        // Как и графы, каждый процесс распределённого перебора пишет свой файл
+        const string name = (distributed && !telemetryName.empty()) ? telemetryName + "." + to_string(MPI_rank) : telemetryName;
+        if(!tm.start("sifter", MPI_rank, name, telemetryInterval))
+        {
+            cerr << "Не удалось открыть файл " << name << endl;
+            return 7;
+        }
+    }
+
     #if SIFTER_DEBUG_LOG >= 3
     omp_set_num_threads(1);
     #endif
@@ -128,22 +316,50 @@ int main(int argc, char ** argv)
 
     vector<vector<uint> > templates;
     // Создание заготовок
-    uint startPort = p + 1; //!< Порт ввода
+    tm.phase("templates");
     {
-        uint T; //!< Число заготовок
-        do
+        TRACE_SCOPE("templates");
+
+        if(MPI_rank == 0)
         {
-            --startPort;
-            T = fact(p + 2*(bs+dc+w), 2*(bs+dc+w) + startPort);
-        } while(T < 10 * ompThreads && startPort != 0);
+            if(resume)
+            {
+                // Заготовки должны совпасть с прерванным запуском, а не зависеть от числа потоков
+                vector<pair<uint, bool> > g(p + 2*(bs+dc+w), pair<uint, bool>(0, false));
+                make_templates_graphs(startPort, p, g, templates);
+            }
+            else
+            {
+                // С контрольной точкой заготовки мельче: при возобновлении повторяются
+                // только заготовки, которые были в работе, а их не больше окна в sift_range
+                const size_t perThread = checkpointName.empty() ? 10 : 100;
+                startPort = make_templates(p, 2*(bs+dc+w), perThread * ompThreads * max(MPI_size - 1, 1), templates);
+            }
+        }
 
-        #if SIFTER_DEBUG_LOG >= 1
-        cout << "Templates to create (" << startPort << " to " << p << "): " << T << endl;
+        #ifdef QSS_MPI
+        // Остальные процессы строят те же заготовки по startPort процесса 0
+        MPI_Bcast(&startPort, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+        if(MPI_rank != 0)
+        {
+            vector<pair<uint, bool> > g(p + 2*(bs+dc+w), pair<uint, bool>(0, false));
+            make_templates_graphs(startPort, p, g, templates);
+        }
         #endif
 
-        templates.reserve(T);
-        vector<pair<uint, bool> > g(p + 2*(bs+dc+w), pair<uint, bool>(0, false));
-        make_templates_graphs(startPort, p, g, templates);
+        // Отметки остальных процессов приходят от процесса 0
+        if(!resume || MPI_rank != 0)
+        done.assign(templates.size(), 0);
+        else
+        if(templates.size() != done.size())
+        {
+            cerr << "Контрольная точка не соответствует заготовкам" << endl;
+            return 8;
+        }
+
+        #if SIFTER_DEBUG_LOG >= 1
+        cout << "Templates created (" << startPort << " to " << p << ")" << endl;
+        #endif
 
         #if SIFTER_DEBUG_LOG >= 1
         cout << "Templates quantity: " << templates.size() << endl;
@@ -163,155 +379,335 @@ int main(int argc, char ** argv)
         #endif
     }
 
-    cout << p << '\t' << bs << '\t' << dc << '\t' << w << endl;
-    #pragma omp parallel for schedule(guided)
-    for(size_t templ = 0; templ < templates.size(); ++templ)
-    {
-        //! Заготовка
-        vector<uint> &T = templates[templ];
-        graph g(p, bs, dc, w);
-        
-        vector<uint> e(T);
-
-        vector<bool> busy(T.size(), false);
-        for(size_t i = 2*(bs+dc+w)+startPort; i < T.size(); ++i)
-        busy[e[i]] = true;
-
-        print_sifted_graphs(0, e, busy, startPort, p, g, sM);
+    #ifdef QSS_MPI
+    MPI_Bcast(done.data(), done.size(), MPI_CHAR, 0, MPI_COMM_WORLD);
+    #endif
 
-        #pragma omp critical(stderr)
-        {
-            static uint toShow = 50;
-            static uint processed = 0;
-            if(++processed % (templates.size()/toShow) == 0)
-            cerr << round(100 * float(processed) / templates.size()) << "% templates (" 
-                << round(100 * float(graphs_generated)/graphs_to_generate) << "% graphs generated)" << endl;
-        }
-    }
+    //! Номера ещё не перебранных заготовок. Процесс 0 раздаёт диапазоны этого списка.
+    vector<size_t> todo;
+    for(size_t templ = 0; templ < templates.size(); ++templ)
+    if(!done[templ]) todo.push_back(templ);
 
-    cerr << "Generated graphs: " << graphs_generated << endl;
+    //! Контрольная точка ведётся внутри sift_range(), а не процессом 0
+    const bool localCheckpoint = !checkpointName.empty() && !distributed;
 
-    return 0;
-}
+    const vector<vector<uint> > perms = symmetry ? make_symmetries(bs, dc, w) : vector<vector<uint> >();
 
-uint fact(const uint _top, const uint _bot/* = 1*/)
-{
-    if(_top == _bot)
-    return 1;
-    else return _top * fact(_top - 1, _bot);
-}
+    if(outName.empty() && !resume)
+    cout << p << '\t' << bs << '\t' << dc << '\t' << w << endl;
 
-void make_templates_graphs(
-    uint _i,
-    uint _p, 
-    std::vector<std::pair<uint, bool> > _g, 
-    std::vector<std::vector<uint> > &answer)
-{
-    const size_t &s = _g.size();
-	if (_i < _p)
-	{
-		for (uint to = 0; to < _g.size(); to++)//Номер узла, куда смотрит порт ввода
-		{
-			if (!_g[to].second)
-			{
-				_g[s - _p + _i].first = to;
-				_g[to].second = true;
-				make_templates_graphs(_i + 1, _p, _g, answer);
-				_g[to].second = false;
-			}
-		}
-	}
-    else 
+    //! Графы копятся в буферах потоков, на стандартный вывод или в файл их пишет отдельный поток
+    buffered_output out(ompThreads);
+    if(outName.empty())
     {
-        answer.push_back(std::vector<uint>(_g.size(), 0));
-        for(size_t i = 0; i < _g.size(); ++i)
-        answer.back()[i] = _g[i].first;
+        // Заголовок из cout должен оказаться в выводе раньше графов
+        cout.flush();
+        out.start(STDOUT_FILENO);
     }
-}
+    else
+    if(!(distributed && MPI_rank == 0))
+    out.start(writer.descriptor());
 
-void print_sifted_graphs(
-    uint me, 
-    std::vector<uint> _e, 
-    std::vector<bool> _busy,
-    const uint _sP, 
-    const uint _fP,
-    graph &_g,
-    const graph::smatrix_t &_sM)
-{
-    #if SIFTER_DEBUG_LOG >= 3
-    #pragma omp critical(stdout)
+    //! Строка как у cout << i << '\t': узлов не больше 64, номера не длиннее двух цифр
+    const enumerator::visit_t print = [&out](const vector<uint> &_e)
     {
-        std::cout << "templ #" << omp_get_thread_num() << " recursive: ";
+        char line[3*64 + 1];
+        char *c = line;
         for(auto i : _e)
-        std::cout << i << '\t';
-        std::cout << std::endl;
-    }
-    #endif
+        {
+            if(i >= 10) *c++ = '0' + i / 10;
+            *c++ = '0' + i % 10;
+            *c++ = '\t';
+        }
+        *c++ = '\n';
 
-    const std::vector<bool> BUSY_TRUE(_busy.size(), true);
-    if(_busy == BUSY_TRUE)
+        out.write(line, c - line);
+    };
+
+    const enumerator::visit_t save = [&out](const vector<uint> &_e)
+    {
+        unsigned char record[64];
+        graph_writer::encode(_e, record);
+        out.write(record, _e.size());
+    };
+
+    sift_context_t ctx;
+    ctx.sP = startPort;
+    ctx.last = 2*(bs+dc+w) + startPort;
+    ctx.splitTo = splitDepth;
+    ctx.sM = &sM;
+    ctx.visit = outName.empty() ? &print : &save;
+    ctx.en.resize(ompThreads);
+    ctx.g.resize(ompThreads);
+
+    double lastCheckpoint = omp_get_wtime();
+
+    //! Перебирает заготовки с номерами _todo[0.._count) всеми потоками процесса
+    auto sift_range = [&](const size_t *_todo, size_t _count)
     {
-        // В этой ветке мы уже прошлись по всем исходящим вершинам графа.
-        // Теперь в _e полностью запоненный массив, представляющий собой направленный граф.
-        #pragma omp atomic
-        ++graphs_generated;        
-
-        _g.set_edges(_e);
-        
-        #if SIFTER_DEBUG_LOG >= 3
-        #pragma omp critical(stdout)
+        #pragma omp parallel
         {
-            std::cout << "thread #" << omp_get_thread_num() << " try: ";
-            for(auto i : _e)
-            std::cout << i << '\t';
-            std::cout << std::endl;
+            TRACE_SCOPE("sift_range");
+
+            graph g(p, bs, dc, w);
+            g.set_engine(engine);
+
+            enumerator en(p, bs, dc, w);
+            en.set_symmetries(perms);
+
+            ctx.g[omp_get_thread_num()] = &g;
+            ctx.en[omp_get_thread_num()] = &en;
+            #pragma omp barrier
+
+            // Заготовки раздаются задачами; заготовка считается завершённой,
+            // когда завершены все задачи её поддеревьев. С контрольной точкой задачи
+            // создаются окнами по 2 на поток: иначе в работе сразу все заготовки,
+            // отмечаются они лишь под конец, и при возобновлении почти всё выводится снова
+            const size_t window = localCheckpoint ? 2 * size_t(ompThreads) : _count;
+
+            #pragma omp single
+            for(size_t k = 0; k < _count; ++k)
+            {
+                const size_t templ = _todo[k];
+
+                if(k > 0 && k % window == 0)
+                {
+                    #pragma omp taskwait
+                }
+
+                #pragma omp task firstprivate(templ)
+                {
+                    {
+                        TRACE_SCOPE("template");
+                        #pragma omp taskgroup
+                        sift_subtree(&ctx, enumerator::subtree_t{templates[templ], 0});
+                    }
+
+                    if(localCheckpoint)
+                    #pragma omp critical(checkpoint)
+                    {
+                        done[templ] = 1;
+
+                        if(omp_get_wtime() - lastCheckpoint >= checkpointInterval)
+                        {
+                            TRACE_SCOPE("checkpoint");
+
+                            // Всё, что выведено по завершённым заготовкам, должно попасть на диск раньше отметки.
+                            // Вместе с ним пишутся и графы ещё идущих заготовок - их при возобновлении выведут снова
+                            out.flush();
+
+                            save_checkpoint(checkpointName, p, bs, dc, w, startPort, done);
+                            lastCheckpoint = omp_get_wtime();
+                        }
+                    }
+
+                    tm.work_done();
+                }
+            }
         }
-        #endif
+    };
 
-        if(_g.sift(_sM))
+    tm.phase("sift");
+
+    if(!distributed)
+    {
+        tm.set_work(templates.size(), templates.size() - todo.size());
+        sift_range(todo.data(), todo.size());
+    }
+    #ifdef QSS_MPI
+    else
+    if(MPI_rank == 0)
+    {
+        // Раздача: рабочий процесс присылает только что перебранный диапазон [begin, end)
+        // списка todo и получает следующий. Пустой диапазон - сигнал завершения.
+        const size_t workers = MPI_size - 1;
+        size_t next = 0;
+        tm.set_work(todo.size());
+        for(size_t active = workers; active > 0;)
         {
-            #pragma omp critical(stdout)
+            unsigned long long range[2];
+            MPI_Status status;
+            MPI_Recv(range, 2, MPI_UNSIGNED_LONG_LONG, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
+
+            if(range[1] > range[0])
             {
-                for(auto i : _e)
-                std::cout << i << '\t';
-                std::cout << std::endl;
+                // Рабочий процесс сбросил свой файл до отчёта, так что отметка не опережает данные
+                for(size_t k = range[0]; k < range[1]; ++k)
+                done[todo[k]] = 1;
+                tm.work_done(range[1] - range[0]);
+
+                if(!checkpointName.empty() && omp_get_wtime() - lastCheckpoint >= checkpointInterval)
+                {
+                    save_checkpoint(checkpointName, p, bs, dc, w, startPort, done);
+                    lastCheckpoint = omp_get_wtime();
+                }
             }
 
+            // Как schedule(guided): чем меньше осталось, тем мельче диапазоны
+            const size_t chunk = max<size_t>(1, (todo.size() - next) / (2 * workers));
+            range[0] = next;
+            range[1] = next = min(next + chunk, todo.size());
+            if(range[0] == range[1]) --active;
+
+            MPI_Send(range, 2, MPI_UNSIGNED_LONG_LONG, status.MPI_SOURCE, 0, MPI_COMM_WORLD);
         }
     }
     else
-	//Необходимо достроить направленный граф g
-	if (me < (_e.size() - _fP))//Если мы сейчас стартуем из однокубитового оператора
-	{
-        //! Узел, куда смотрит порт выхода однокубитового оператора
-		for (uint i = (me / 2) * 2 + 2; i < _e.size(); i++)
-		{
-			if (!_busy[i])
-			{
-				_busy[i] = true;
-				_e[me] = i;
-				print_sifted_graphs(me + 1, _e, _busy, _sP, _fP, _g, _sM);
-				_busy[i] = false;
-			}
-		}
-	}
-	else//В этой точке мы стартуем из порта ввода
     {
-        if (me < (_e.size() - _sP))
-        //Порт ввода может смотреть в любой узел графа
-        for (uint i = 0; i < _e.size(); i++)
+        unsigned long long range[2] = {0, 0};
+        while(true)
+        {
+            MPI_Send(range, 2, MPI_UNSIGNED_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+            MPI_Recv(range, 2, MPI_UNSIGNED_LONG_LONG, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if(range[0] == range[1]) break;
+
+            sift_range(todo.data() + range[0], range[1] - range[0]);
+            out.flush();
+        }
+    }
+
+    #endif
+
+    tm.phase("finish");
+    out.close();
+    writer.close();
+
+    if(out.failed())
+    cerr << "Ошибка записи графов" << endl;
+
+    //! Полностью построенные, выведенные, отсечённые и пропущенные симметричные
+    unsigned long long total[4] = {
+        tm.total(telemetry::leaves), tm.total(telemetry::siftedGraphs),
+        tm.total(telemetry::prunedSubtrees), tm.total(telemetry::symmetricGraphs)};
+
+    #ifdef QSS_MPI
+    // Счётчики собираются на процессе 0
+    MPI_Reduce(MPI_rank == 0 ? MPI_IN_PLACE : total, total, 4, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    #endif
+
+    if(!checkpointName.empty() && MPI_rank == 0)
+    {
+        cout.flush();
+        save_checkpoint(checkpointName, p, bs, dc, w, startPort, done);
+    }
+
+    tm.stop();
+
+    #if QSS_TRACE >= 1
+    {
+        // Файл трассировки: QSS_TRACE_FILE или sifter.trace.json, у процессов MPI - с номером процесса
+        const char *env = getenv("QSS_TRACE_FILE");
+        const string name = string(env != NULL ? env : "sifter.trace.json") + (distributed ? "." + to_string(MPI_rank) : "");
+        if(!TRACE_DUMP(name, MPI_rank))
+        cerr << "Не удалось записать " << name << endl;
+    }
+    #endif
+
+    if(MPI_rank == 0)
+    {
+        cerr << "Generated graphs: " << total[0] << endl;
+        cerr << "Sifted graphs: " << total[1] << endl;
+        cerr << "Pruned subtrees: " << total[2] << endl;
+        if(symmetry)
+        cerr << "Skipped symmetric graphs: " << total[3] << endl;
+    }
+
+    #ifdef QSS_MPI
+    MPI_Finalize();
+    #endif
+
+    return 0;
+}
+
+/*
+ * @brief Переносит счётчики перечислителя в ячейку потока телеметрии и обнуляет их.
+ *  Вызывается раз на поддерево, а не на каждый узел перебора.
+ */
+static void publish_counters(enumerator &_en)
+{
+    telemetry &tm = global_telemetry();
+    tm.add(telemetry::nodesVisited, _en.visited);
+    tm.add(telemetry::leaves, _en.leaves);
+    tm.add(telemetry::prunedSubtrees, _en.pruned);
+    tm.add(telemetry::symmetricGraphs, _en.symmetric);
+    tm.add(telemetry::siftedGraphs, _en.sifted);
+    _en.visited = _en.leaves = _en.pruned = _en.symmetric = _en.sifted = 0;
+}
+
+void sift_subtree(const sift_context_t *_c, const enumerator::subtree_t &_s)
+{
+    TRACE_SCOPE("subtree");
+
+    const int t = omp_get_thread_num();
+    enumerator &en = *_c->en[t];
+
+    if(_s.depth < _c->splitTo && _s.depth + SPLIT_MIN_REST < _c->last)
+    {
+        std::vector<enumerator::subtree_t> children;
+        if(en.split(_s, _c->sP, *_c->g[t], children))
         {
-            if (!_busy[i])
+            publish_counters(en);
+
+            // Задачи создаются только после split(): в точке создания задачи поток
+            // может сразу взяться за другую задачу со своим же перечислителем
+            for(size_t i = 0; i < children.size(); ++i)
             {
-                _busy[i] = true;
-                _e[me] = i;
-                print_sifted_graphs(me + 1, _e, _busy, _sP, _fP, _g, _sM);
-                _busy[i] = false;
+                enumerator::subtree_t child = std::move(children[i]);
+                #pragma omp task firstprivate(child)
+                sift_subtree(_c, child);
             }
+            return;
         }
-        else
-        {
-            
-        }//Конец обработки сгенерированного направленного графа}
     }
+
+    // В run() нет точек переключения задач, поэтому перечислитель потока занят только этой задачей
+    en.run(_s, _c->sP, *_c->g[t], *_c->sM, *_c->visit);
+    publish_counters(en);
+}
+
+bool save_checkpoint(
+    const std::string &_name,
+    uint _p, uint _bs, uint _dc, uint _w,
+    uint _sP,
+    const std::vector<char> &_done)
+{
+    const std::string tmp = _name + ".tmp";
+    {
+        std::ofstream f(tmp);
+        f << _p << '\t' << _bs << '\t' << _dc << '\t' << _w << '\t' 
+            << _sP << '\t' << _done.size() << std::endl;
+
+        for(auto d : _done)
+        f << (d ? '1' : '0');
+        f << std::endl;
+
+        f.flush();
+        if(!f) return false;
+    }
+
+    return rename(tmp.c_str(), _name.c_str()) == 0;
+}
+
+bool load_checkpoint(
+    const std::string &_name,
+    uint _p, uint _bs, uint _dc, uint _w,
+    uint &_sP,
+    std::vector<char> &_done)
+{
+    std::ifstream f(_name);
+    if(!f.is_open()) return false;
+
+    uint p, bs, dc, w;
+    size_t T;
+    std::string marks;
+    f >> p >> bs >> dc >> w >> _sP >> T >> marks;
+
+    if(!f || p != _p || bs != _bs || dc != _dc || w != _w || marks.size() != T)
+    return false;
+
+    _done.resize(T);
+    for(size_t i = 0; i < T; ++i)
+    _done[i] = (marks[i] == '1');
+
+    return true;
 }
@@ -0,0 +1,220 @@
+#ifndef SIMD_CPP
+#define SIMD_CPP
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "simd.hpp"
+
+// Тела ядер пишутся один раз и встраиваются в обёртки с разными target:
+// компилятор векторизует одни и те же циклы под каждый набор инструкций.
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+static SIMD_INLINE void oper_sqrt_body(const double *__restrict _v, size_t _n, double *__restrict _a, double *__restrict _b)
+{
+	// sqrt векторизуется только без errno: файл собирается с -fno-math-errno
+	#pragma omp simd
+	for(size_t s = 0; s < _n; ++s)
+	{
+		_a[s] = sqrt(_v[s]);
+		_b[s] = sqrt(1. - _v[s]);
+	}
+}
+
+static SIMD_INLINE void path_sum_body(
+	size_t _cells, const uint *_cell, const uint *_path, const uint *_hop,
+	const double *_fr, const double *_fi, size_t _n,
+	double *_ar, double *_ai, double *__restrict _pr, double *__restrict _pi)
+{
+	for(size_t c = 0; c < _cells; ++c)
+	{
+		double *__restrict sr = _ar + c*_n;
+		double *__restrict si = _ai + c*_n;
+
+		#pragma omp simd
+		for(size_t s = 0; s < _n; ++s)
+		sr[s] = si[s] = 0.;
+
+		for(uint t = _cell[c]; t < _cell[c + 1]; ++t)
+		{
+			#pragma omp simd
+			for(size_t s = 0; s < _n; ++s)
+			{
+				_pr[s] = 1.;
+				_pi[s] = 0.;
+			}
+
+			for(uint h = _path[t]; h < _path[t + 1]; ++h)
+			{
+				const double *__restrict ur = _fr + _hop[h]*_n;
+				const double *__restrict ui = _fi + _hop[h]*_n;
+
+				#pragma omp simd
+				for(size_t s = 0; s < _n; ++s)
+				{
+					const double r = _pr[s]*ur[s] - _pi[s]*ui[s];
+					_pi[s] = _pr[s]*ui[s] + _pi[s]*ur[s];
+					_pr[s] = r;
+				}
+			}
+
+			#pragma omp simd
+			for(size_t s = 0; s < _n; ++s)
+			{
+				sr[s] += _pr[s];
+				si[s] += _pi[s];
+			}
+		}
+	}
+}
+
+static SIMD_INLINE void transfer_body(
+	uint _p, uint _q, const uint *_edges, const uint *_order, size_t _ops,
+	const double *_fr, const double *_fi, size_t _n,
+	double *_wr, double *_wi, double *_ar, double *_ai)
+{
+	for(uint i = 0; i < _p; ++i)
+	{
+		std::fill(_wr, _wr + (_q + _p)*_n, 0.);
+		std::fill(_wi, _wi + (_q + _p)*_n, 0.);
+		std::fill(_wr + _edges[_q + i]*_n, _wr + (_edges[_q + i] + 1)*_n, 1.);
+
+		for(size_t o = 0; o < _ops; ++o)
+		{
+			const uint k = _order[o];
+
+			// Выходы оператора смотрят вперёд, поэтому входы и выходы не пересекаются
+			const double *__restrict a0r = _wr + 2*k*_n, *__restrict a0i = _wi + 2*k*_n;
+			const double *__restrict a1r = a0r + _n, *__restrict a1i = a0i + _n;
+			const double *__restrict ur = _fr + 4*k*_n, *__restrict ui = _fi + 4*k*_n;
+			double *__restrict b0r = _wr + _edges[2*k]*_n, *__restrict b0i = _wi + _edges[2*k]*_n;
+			double *__restrict b1r = _wr + _edges[2*k + 1]*_n, *__restrict b1i = _wi + _edges[2*k + 1]*_n;
+
+			#pragma omp simd
+			for(size_t s = 0; s < _n; ++s)
+			{
+				const double xr = a0r[s], xi = a0i[s], yr = a1r[s], yi = a1i[s];
+				const double u0r = ur[s], u0i = ui[s];
+				const double u1r = ur[_n + s], u1i = ui[_n + s];
+				const double u2r = ur[2*_n + s], u2i = ui[2*_n + s];
+				const double u3r = ur[3*_n + s], u3i = ui[3*_n + s];
+
+				b0r[s] += (xr*u0r - xi*u0i) + (yr*u2r - yi*u2i);
+				b0i[s] += (xr*u0i + xi*u0r) + (yr*u2i + yi*u2r);
+				b1r[s] += (xr*u1r - xi*u1i) + (yr*u3r - yi*u3i);
+				b1i[s] += (xr*u1i + xi*u1r) + (yr*u3i + yi*u3r);
+			}
+		}
+
+		for(uint j = 0; j < _p; ++j)
+		{
+			memcpy(_ar + (i*_p + j)*_n, _wr + (_q + j)*_n, _n*sizeof(double));
+			memcpy(_ai + (i*_p + j)*_n, _wi + (_q + j)*_n, _n*sizeof(double));
+		}
+	}
+}
+
+static SIMD_INLINE void tape_body(
+	size_t _leaves, const uint *_leaf,
+	size_t _ops, const uint *_kind, const uint *_a, const uint *_b,
+	const double *_fr, const double *_fi, size_t _n,
+	double *_rr, double *_ri)
+{
+	std::fill(_rr, _rr + _n, 1.);
+	std::fill(_ri, _ri + _n, 0.);
+
+	for(size_t l = 0; l < _leaves; ++l)
+	{
+		memcpy(_rr + (1 + l)*_n, _fr + _leaf[l]*_n, _n*sizeof(double));
+		memcpy(_ri + (1 + l)*_n, _fi + _leaf[l]*_n, _n*sizeof(double));
+	}
+
+	for(size_t k = 0; k < _ops; ++k)
+	{
+		// Команда пишет регистр за всеми своими аргументами
+		const double *__restrict xr = _rr + _a[k]*_n, *__restrict xi = _ri + _a[k]*_n;
+		const double *__restrict yr = _rr + _b[k]*_n, *__restrict yi = _ri + _b[k]*_n;
+		double *__restrict zr = _rr + (1 + _leaves + k)*_n, *__restrict zi = _ri + (1 + _leaves + k)*_n;
+
+		if(_kind[k])
+		{
+			#pragma omp simd
+			for(size_t s = 0; s < _n; ++s)
+			{
+				zr[s] = xr[s] + yr[s];
+				zi[s] = xi[s] + yi[s];
+			}
+		}
+		else
+		{
+			#pragma omp simd
+			for(size_t s = 0; s < _n; ++s)
+			{
+				zr[s] = xr[s]*yr[s] - xi[s]*yi[s];
+				zi[s] = xr[s]*yi[s] + xi[s]*yr[s];
+			}
+		}
+	}
+}
+
+#define SIMD_VARIANT(SUFFIX, TARGET) \
+	static TARGET void oper_sqrt_##SUFFIX(const double *_v, size_t _n, double *_a, double *_b) \
+	{ \
+		oper_sqrt_body(_v, _n, _a, _b); \
+	} \
+	static TARGET void path_sum_##SUFFIX( \
+		size_t _cells, const uint *_cell, const uint *_path, const uint *_hop, \
+		const double *_fr, const double *_fi, size_t _n, \
+		double *_ar, double *_ai, double *_pr, double *_pi) \
+	{ \
+		path_sum_body(_cells, _cell, _path, _hop, _fr, _fi, _n, _ar, _ai, _pr, _pi); \
+	} \
+	static TARGET void transfer_##SUFFIX( \
+		uint _p, uint _q, const uint *_edges, const uint *_order, size_t _ops, \
+		const double *_fr, const double *_fi, size_t _n, \
+		double *_wr, double *_wi, double *_ar, double *_ai) \
+	{ \
+		transfer_body(_p, _q, _edges, _order, _ops, _fr, _fi, _n, _wr, _wi, _ar, _ai); \
+	} \
+	static TARGET void tape_##SUFFIX( \
+		size_t _leaves, const uint *_leaf, \
+		size_t _ops, const uint *_kind, const uint *_a, const uint *_b, \
+		const double *_fr, const double *_fi, size_t _n, \
+		double *_rr, double *_ri) \
+	{ \
+		tape_body(_leaves, _leaf, _ops, _kind, _a, _b, _fr, _fi, _n, _rr, _ri); \
+	}
+
+SIMD_VARIANT(scalar, )
+SIMD_VARIANT(avx2, __attribute__((target("avx2,fma"))))
+SIMD_VARIANT(avx512, __attribute__((target("avx512f"))))
+
+static simd_kernels_t select_kernels()
+{
+	//! Верхняя граница выбора из QSS_SIMD
+	const char *env = getenv("QSS_SIMD");
+	const int limit =
+		(env == NULL) ? 2 :
+		(strcmp(env, "scalar") == 0) ? 0 :
+		(strcmp(env, "avx2") == 0) ? 1 : 2;
+
+	__builtin_cpu_init();
+
+	if(limit >= 2 && __builtin_cpu_supports("avx512f"))
+	return simd_kernels_t{"avx512", &oper_sqrt_avx512, &path_sum_avx512, &transfer_avx512, &tape_avx512};
+
+	if(limit >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	return simd_kernels_t{"avx2", &oper_sqrt_avx2, &path_sum_avx2, &transfer_avx2, &tape_avx2};
+
+	return simd_kernels_t{"scalar", &oper_sqrt_scalar, &path_sum_scalar, &transfer_scalar, &tape_scalar};
+}
+
+const simd_kernels_t &simd_kernels()
+{
+	// Инициализация статической переменной потокобезопасна (C++11)
+	static const simd_kernels_t kernels = select_kernels();
+	return kernels;
+}
+
+#endif //! SIMD_CPP
@@ -0,0 +1,77 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <stdlib.h>
+
+/*
+ * @brief Векторные ядра пакетного вычисления отклонений (graph::get_deviation(x, n, ...)).
+ *  Комплексные массивы хранятся раздельно - действительные и мнимые части,
+ *  каждая как [элемент][набор] с шагом _n. Внутренний цикл всегда идёт по наборам
+ *  переменных, поэтому он векторизуется без зависимостей и без веток
+ *  восстановления NaN/Inf, которые есть в умножении std::complex.
+ *
+ *  Ядра собраны в трёх вариантах: AVX-512, AVX2+FMA и скалярном. Вариант
+ *  выбирается при первом вызове simd_kernels() по __builtin_cpu_supports().
+ *  Переменная окружения QSS_SIMD=scalar|avx2|avx512 ограничивает выбор сверху.
+ */
+struct simd_kernels_t
+{
+	const char *name;	//!< "avx512", "avx2" или "scalar"
+
+	/*
+	 * @brief Корни светоделителей: _a = sqrt(v), _b = sqrt(1 - v).
+	 *  Для v из [0, 1] совпадает с комплексным sqrt() из graph::make_func().
+	 */
+	void (*oper_sqrt)(const double *_v, size_t _n, double *_a, double *_b);
+
+	/*
+	 * @brief Суммы произведений вдоль траекторий (pathEnumeration)
+	 *
+	 * @param _cells			Число ячеек матрицы амплитуд
+	 * @param _cell, _path, _hop	Скомпилированная программа (graph::program_t)
+	 * @param _fr, _fi			Таблицы func, [код перехода][набор]
+	 * @param _n				Число наборов
+	 * @param _ar, _ai			Сюда пишутся амплитуды, [ячейка][набор]
+	 * @param _pr, _pi			Рабочие массивы на _n элементов
+	 */
+	void (*path_sum)(
+		size_t _cells, const uint *_cell, const uint *_path, const uint *_hop,
+		const double *_fr, const double *_fi, size_t _n,
+		double *_ar, double *_ai, double *_pr, double *_pi);
+
+	/*
+	 * @brief Распространение амплитуд от всех портов ввода (transferMatrix)
+	 *
+	 * @param _edges			Рёбра графа
+	 * @param _order, _ops		Топологический порядок операторов и его длина
+	 * @param _fr, _fi			Таблицы func, [код перехода][набор]
+	 * @param _n				Число наборов
+	 * @param _wr, _wi			Рабочие массивы на (_q + _p)*_n элементов
+	 * @param _ar, _ai			Сюда пишутся амплитуды, [ячейка][набор]
+	 */
+	void (*transfer)(
+		uint _p, uint _q, const uint *_edges, const uint *_order, size_t _ops,
+		const double *_fr, const double *_fi, size_t _n,
+		double *_wr, double *_wi, double *_ar, double *_ai);
+
+	/*
+	 * @brief Выполнение программы graph::tape_t (symbolicTape)
+	 *
+	 * @param _leaves, _leaf		Листья: коды переходов в таблице func
+	 * @param _ops				Число выполняемых команд
+	 * @param _kind, _a, _b		Команды программы
+	 * @param _fr, _fi			Таблицы func, [код перехода][набор]
+	 * @param _n				Число наборов
+	 * @param _rr, _ri			Сюда пишутся регистры, [регистр][набор]
+	 */
+	void (*tape)(
+		size_t _leaves, const uint *_leaf,
+		size_t _ops, const uint *_kind, const uint *_a, const uint *_b,
+		const double *_fr, const double *_fi, size_t _n,
+		double *_rr, double *_ri);
+};
+
+//! Ядра для текущего процессора
+const simd_kernels_t &simd_kernels();
+
+#endif //! SIMD_HPP
@@ -0,0 +1,142 @@
+#ifndef STATIC_GRAPH_HPP
+#define STATIC_GRAPH_HPP
+
+#include <array>
+#include <complex>
+#include <algorithm>
+#include <stdlib.h>
+
+/*
+ * @brief Вычисление отклонения для графа фиксированного размера (graph::staticKernel).
+ *  Типы операторов влияют только на таблицу func, которую строит graph::make_func(),
+ *  поэтому шаблон зависит лишь от числа портов P и числа операторов N.
+ *  Все массивы - std::array, циклы имеют известную при компиляции длину.
+ */
+class static_graph_base
+{
+public:
+	virtual ~static_graph_base() {}
+
+	/*
+	 * @brief Отклонение от целевой матрицы при таблице операторов _func
+	 *  (та же раскладка, что graph::func)
+	 */
+	virtual double deviation(const std::complex<double> *_func) const = 0;
+};
+
+/*
+ * @brief Граф с P портами и N операторами.
+ *  Ячейки translate лежат в строках и столбцах 0..3, поэтому амплитуды
+ *  распространяются только от первых четырёх портов ввода и сразу
+ *  сворачиваются в отклонение, без матрицы амплитуд и выделений памяти.
+ */
+template<uint P, uint N>
+class static_graph : public static_graph_base
+{
+	static_assert(P >= 4, "translate references ports 0..3");
+
+public:
+	static constexpr uint Q = 2*N;	//!< Число узлов операторов
+
+	//! Та же таблица, что graph::translate: T[i][j] = A*B + C*D
+	static constexpr uint translate[4][4][4] = {
+		{{1,1, 3,3}, {1,1, 2,3}, {0,1, 3,3}, {0,1, 2,3}},
+		{{1,1, 3,2}, {1,1, 2,2}, {0,1, 3,2}, {0,1, 2,2}},
+		{{1,0, 3,3}, {1,0, 2,3}, {0,0, 3,3}, {0,0, 2,3}},
+		{{1,0, 3,2}, {1,0, 2,2}, {0,0, 3,2}, {0,0, 2,2}}
+	};
+
+	/*
+	 * @param _edges	Рёбра графа, Q + P элементов
+	 * @param _order	Топологический порядок операторов (graph::order)
+	 * @param _tM		Целевая матрица, построчно P*P элементов
+	 */
+	static_graph(const uint *_edges, const uint *_order, const std::complex<double> *_tM)
+	{
+		std::copy(_edges, _edges + Q + P, edges.begin());
+		std::copy(_order, _order + N, order.begin());
+
+		rest = 0.;
+		for(uint i = 0; i < P; ++i)
+		for(uint j = 0; j < P; ++j)
+		if(i < 4 && j < 4)
+		target[i*4 + j] = _tM[i*P + j];
+		else
+		rest += abs(_tM[i*P + j]);
+	}
+
+	double deviation(const std::complex<double> *_func) const
+	{
+		//! Амплитуды [вход][выход] для портов 0..3
+		std::complex<double> a[4][4];
+		std::complex<double> wave[Q + P];
+
+		for(uint i = 0; i < 4; ++i)
+		{
+			std::fill(wave, wave + Q + P, 0.);
+			wave[edges[Q + i]] = 1.;
+
+			for(uint o = 0; o < N; ++o)
+			{
+				const uint k = order[o];
+				const std::complex<double> a0 = wave[2*k], a1 = wave[2*k + 1];
+				const std::complex<double> *u = _func + 4*k;
+
+				wave[edges[2*k]]     += a0*u[0] + a1*u[2];
+				wave[edges[2*k + 1]] += a0*u[1] + a1*u[3];
+			}
+
+			for(uint j = 0; j < 4; ++j)
+			a[i][j] = wave[Q + j];
+		}
+
+		double d = 0.;
+		for(uint i = 0; i < 4; ++i)
+		for(uint j = 0; j < 4; ++j)
+		{
+			const uint *m = translate[i][j];
+			d += abs(a[m[0]][m[1]] * a[m[2]][m[3]] + a[m[0]][m[3]] * a[m[2]][m[1]] - target[i*4 + j]);
+		}
+
+		return d + rest;
+	}
+
+protected:
+	std::array<uint, Q + P> edges;
+	std::array<uint, N> order;
+	std::array<std::complex<double>, 16> target;	//!< Целевые ячейки translate
+	double rest;									//!< Сумма |целевой| вне translate
+};
+
+template<uint P, uint N>
+constexpr uint static_graph<P, N>::translate[4][4][4];
+
+//! Собираемые размеры (P, N): p = 4 и p = 6
+#define STATIC_GRAPH_SIZES(X) \
+	X(4, 1) X(4, 2) X(4, 3) X(4, 4) X(4, 5) X(4, 6) X(4, 7) X(4, 8) \
+	X(6, 1) X(6, 2) X(6, 3) X(6, 4) X(6, 5) X(6, 6) X(6, 7) X(6, 8) X(6, 9) X(6, 10)
+
+//! true, если static_graph собран для _p портов и _n операторов
+inline bool static_graph_supported(uint _p, uint _n)
+{
+	#define STATIC_GRAPH_CASE(P, N) if(_p == P && _n == N) return true;
+	STATIC_GRAPH_SIZES(STATIC_GRAPH_CASE)
+	#undef STATIC_GRAPH_CASE
+	return false;
+}
+
+/*
+ * @brief Создаёт static_graph нужного размера
+ *
+ * @return NULL, если размер не собран (см. STATIC_GRAPH_SIZES)
+ */
+inline static_graph_base *make_static_graph(
+	uint _p, uint _n, const uint *_edges, const uint *_order, const std::complex<double> *_tM)
+{
+	#define STATIC_GRAPH_CASE(P, N) if(_p == P && _n == N) return new static_graph<P, N>(_edges, _order, _tM);
+	STATIC_GRAPH_SIZES(STATIC_GRAPH_CASE)
+	#undef STATIC_GRAPH_CASE
+	return NULL;
+}
+
+#endif //! STATIC_GRAPH_HPP
@@ -0,0 +1,212 @@
+#ifndef TELEMETRY_CPP
+#define TELEMETRY_CPP
+
+#include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+
+#include "telemetry.hpp"
+
+//! Имена счётчиков в строках отчёта, в порядке telemetry::counters_types
+static const char *counter_names[telemetry::countersNumber] = {
+	"nodes", "leaves", "pruned", "symmetric", "sifted", "optimized", "nlopt_runs", "deviations"
+};
+
+telemetry::telemetry()
+{
+	for(uint s = 0; s < TELEMETRY_SLOTS; ++s)
+	for(uint k = 0; k < countersNumber; ++k)
+	slots[s].c[k].store(0, std::memory_order_relaxed);
+
+	done.store(0, std::memory_order_relaxed);
+	work = 0;
+	workStart = 0;
+
+	origin = std::chrono::steady_clock::now();
+	current = "start";
+	currentStart = 0;
+
+	rank = 0;
+	out = NULL;
+	for(uint k = 0; k < countersNumber; ++k) last[k] = 0;
+	lastTime = 0;
+	stopping = false;
+}
+
+telemetry::~telemetry()
+{
+	if(reporter.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		reporter.join();
+	}
+}
+
+uint telemetry::slot()
+{
+	static std::atomic<uint> threads(0);
+	static thread_local const uint id = threads.fetch_add(1, std::memory_order_relaxed) % TELEMETRY_SLOTS;
+	return id;
+}
+
+double telemetry::now() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+}
+
+u_int64_t telemetry::total(counters_types _c) const
+{
+	u_int64_t sum = 0;
+	for(uint s = 0; s < TELEMETRY_SLOTS; ++s)
+	sum += slots[s].c[_c].load(std::memory_order_relaxed);
+	return sum;
+}
+
+void telemetry::set_work(u_int64_t _total, u_int64_t _done)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	work = _total;
+	done.store(_done, std::memory_order_relaxed);
+	workStart = now();
+}
+
+void telemetry::phase(const std::string &_name)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	const double t = now();
+
+	size_t i = 0;
+	while(i < phases.size() && phases[i].first != current) ++i;
+	if(i == phases.size()) phases.push_back(std::make_pair(current, 0.));
+	phases[i].second += t - currentStart;
+
+	current = _name;
+	currentStart = t;
+}
+
+bool telemetry::start(const std::string &_program, int _rank, const std::string &_file, double _interval)
+{
+	program = _program;
+	rank = _rank;
+
+	if(_file.empty())
+	out = &std::cerr;
+	else
+	{
+		file.open(_file, std::ios::app);
+		if(!file.is_open()) return false;
+		out = &file;
+	}
+
+	stopping = false;
+	reporter = std::thread([this, _interval]()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		const std::chrono::duration<double> period(_interval);
+		while(!wake.wait_for(guard, period, [this]() { return stopping; }))
+		emit(false);
+	});
+
+	return true;
+}
+
+void telemetry::stop()
+{
+	if(!reporter.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	reporter.join();
+
+	std::lock_guard<std::mutex> guard(lock);
+	emit(true);
+}
+
+void telemetry::emit(bool _final)
+{
+	const double t = now();
+
+	std::ostringstream s;
+	s << "{\"program\": \"" << program << "\", \"rank\": " << rank
+		<< ", \"time\": " << t << ", \"final\": " << (_final ? "true" : "false")
+		<< ", \"phase\": \"" << current << "\"";
+
+	if(work > 0)
+	{
+		const u_int64_t d = done.load(std::memory_order_relaxed);
+		s << ", \"done\": " << d << ", \"total\": " << work << ", \"progress\": " << double(d) / work;
+
+		// Средняя скорость с начала работы; до первой выполненной единицы оценки нет
+		if(d > 0)
+		s << ", \"eta\": " << (t - workStart) * (work > d ? work - d : 0) / d;
+	}
+
+	{
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		s << ", \"peak_rss_kb\": " << ru.ru_maxrss;
+	}
+
+	u_int64_t value[countersNumber];
+	for(uint k = 0; k < countersNumber; ++k)
+	value[k] = total(counters_types(k));
+
+	s << ", \"counters\": {";
+	bool first = true;
+	for(uint k = 0; k < countersNumber; ++k)
+	if(value[k] != 0)
+	{
+		s << (first ? "" : ", ") << "\"" << counter_names[k] << "\": " << value[k];
+		first = false;
+	}
+
+	s << "}, \"rates\": {";
+	first = true;
+	for(uint k = 0; k < countersNumber; ++k)
+	if(value[k] != 0)
+	{
+		s << (first ? "" : ", ") << "\"" << counter_names[k] << "\": "
+			<< (t > lastTime ? (value[k] - last[k]) / (t - lastTime) : 0.);
+		first = false;
+	}
+
+	s << "}, \"phases\": {";
+	bool running = false;
+	for(size_t i = 0; i < phases.size(); ++i)
+	{
+		// Текущая фаза учитывается вместе с уже идущим временем
+		double sec = phases[i].second;
+		if(phases[i].first == current)
+		{
+			sec += t - currentStart;
+			running = true;
+		}
+		s << (i ? ", " : "") << "\"" << phases[i].first << "\": " << sec;
+	}
+	if(!running)
+	s << (phases.empty() ? "" : ", ") << "\"" << current << "\": " << t - currentStart;
+	s << "}}\n";
+
+	// Строка собрана целиком, чтобы не перемешаться с другими сообщениями
+	*out << s.str();
+	out->flush();
+
+	for(uint k = 0; k < countersNumber; ++k) last[k] = value[k];
+	lastTime = t;
+}
+
+telemetry &global_telemetry()
+{
+	// Инициализация статической переменной потокобезопасна (C++11)
+	static telemetry instance;
+	return instance;
+}
+
+#endif //! TELEMETRY_CPP
@@ -0,0 +1,131 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdlib.h>
+
+//! Ячеек счётчиков. Потоки сверх этого числа делят ячейки, что корректно, но медленнее
+#define TELEMETRY_SLOTS 256
+
+/*
+ * @brief Счётчики работы по потокам и периодический отчёт о ходе вычислений.
+ *  Каждый поток прибавляет к счётчикам своей ячейки; ячейки выровнены по линии
+ *  кэша, поэтому потоки не делят линий, а сумма по ячейкам читается без блокировок.
+ *
+ *  Отдельный поток раз в период пишет строку JSON:
+ *   {"program", "rank", "time", "final", "phase", "done", "total", "progress",
+ *    "eta", "peak_rss_kb", "counters": {...}, "rates": {...}, "phases": {...}}
+ *  rates - прирост счётчиков в секунду с прошлой строки, phases - секунды по фазам,
+ *  eta - оценка оставшегося времени по средней скорости работы (set_work()).
+ *  Нулевые счётчики не печатаются; done, total, progress и eta - только если
+ *  объём работы задан.
+ */
+class telemetry {
+public:
+	enum counters_types
+	{
+		nodesVisited,		//!< Назначенных перебором рёбер (узлов дерева перебора)
+		leaves,				//!< Полностью построенных графов, каждый проходит graph::sift()
+		prunedSubtrees,		//!< Отсечённых поддеревьев
+		symmetricGraphs,	//!< Просеянных, но не канонических графов
+		siftedGraphs,		//!< Выведенных графов
+		graphsOptimized,	//!< Оптимизированных графов
+		nloptRuns,			//!< Запусков NLopt
+		deviations,			//!< Вычислений отклонения, включая наборы пакетных вычислений
+		countersNumber
+	};
+
+	telemetry();
+	~telemetry();
+
+	//! Прибавляет _d к счётчику _c ячейки текущего потока
+	void add(counters_types _c, u_int64_t _d = 1)
+	{
+		slots[slot()].c[_c].fetch_add(_d, std::memory_order_relaxed);
+	}
+
+	//! Сумма счётчика по всем потокам
+	u_int64_t total(counters_types _c) const;
+
+	//! Объём работы (заготовок, графов), из которого уже сделано _done
+	void set_work(u_int64_t _total, u_int64_t _done = 0);
+
+	//! Отмечает выполненными ещё _d единиц работы
+	void work_done(u_int64_t _d = 1)
+	{
+		done.fetch_add(_d, std::memory_order_relaxed);
+	}
+
+	//! Начинает фазу _name, время предыдущей фазы прибавляется к её итогу
+	void phase(const std::string &_name);
+
+	/*
+	 * @brief Запускает поток отчёта
+	 *
+	 * @param _program	Имя программы в строках отчёта
+	 * @param _rank		Номер процесса MPI
+	 * @param _file		Файл для строк (дописывается), пусто - стандартный поток ошибок
+	 * @param _interval	Период, с
+	 *
+	 * @return false, если файл не удалось открыть
+	 */
+	bool start(const std::string &_program, int _rank, const std::string &_file, double _interval);
+
+	//! Останавливает поток отчёта и пишет итоговую строку ("final": true)
+	void stop();
+
+protected:
+	//! Счётчики одного потока, на своей линии кэша
+	struct alignas(64) slot_t
+	{
+		std::atomic<u_int64_t> c[countersNumber];
+	};
+
+	//! Ячейка текущего потока: потоки получают ячейки по порядку первого обращения
+	static uint slot();
+
+	//! Секунды с создания объекта
+	double now() const;
+
+	//! Пишет строку отчёта. Вызывается под lock
+	void emit(bool _final);
+
+	slot_t slots[TELEMETRY_SLOTS];
+
+	std::atomic<u_int64_t> done;
+	u_int64_t work;				//!< Объём работы, 0 - не задан
+	double workStart;			//!< Время set_work()
+
+	std::chrono::steady_clock::time_point origin;
+
+	//! Фаза и время её начала, итоги завершённых фаз в порядке начала
+	std::string current;
+	double currentStart;
+	std::vector<std::pair<std::string, double> > phases;
+
+	std::string program;
+	int rank;
+	std::ofstream file;
+	std::ostream *out;
+
+	//! Значения счётчиков и время прошлой строки, для скоростей
+	u_int64_t last[countersNumber];
+	double lastTime;
+
+	std::thread reporter;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping;
+};
+
+//! Телеметрия процесса
+telemetry &global_telemetry();
+
+#endif //! TELEMETRY_HPP
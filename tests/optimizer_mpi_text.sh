@@ -0,0 +1,61 @@
+#!/bin/sh
+# Текстовый список графов на двух процессах MPI: каждый граф должен
+# оптимизироваться ровно один раз, как на одном процессе.
+#  - с -k не меньше числа графов процесс 0 печатает все графы; их рёбра
+#    должны совпасть со списком, который читает запуск на одном процессе;
+#  - с -u число классов структуры должно совпасть с запуском на одном процессе.
+#
+# Аргументы: путь к sifter, путь к optimizer_mpi, команда запуска MPI (mpiexec ...)
+
+SIFTER=$1
+OPTIMIZER=$2
+shift 2
+MPIEXEC=${*:-mpiexec}
+
+TMP=${TMPDIR:-/tmp}/optimizer_mpi_text.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# Граф 4 порта, 2 светоделителя; целевая матрица - CNOT
+OMP_NUM_THREADS=1 "$SIFTER" -p 0 4 2 0 0 1 1 0 0 1 1 0 0 0 0 1 1 0 0 1 1 > "$TMP/sifted" 2>/dev/null || exit 1
+{
+	head -n 1 "$TMP/sifted"
+	echo "(1,0) (0,0) (0,0) (0,0)"
+	echo "(0,0) (1,0) (0,0) (0,0)"
+	echo "(0,0) (0,0) (0,0) (1,0)"
+	echo "(0,0) (0,0) (1,0) (0,0)"
+	tail -n +2 "$TMP/sifted"
+	# Последняя строка файла оптимизатором не читается
+	echo
+} > "$TMP/graphs.txt"
+tail -n +2 "$TMP/sifted" | sort > "$TMP/expected"
+
+status=0
+top=$(wc -l < "$TMP/expected")
+
+# Рёбра всех графов, напечатанных процессом 0
+edges()
+{
+	awk 'e { print; e = 0 } /^Edges:/ { e = 1 }' | sort
+}
+
+for unique in "" "-u"
+do
+	OMP_NUM_THREADS=1 $MPIEXEC -np 2 "$OPTIMIZER" -p 0 -c 0 -k "$top" $unique "$TMP/graphs.txt" 2> "$TMP/err2" | edges > "$TMP/edges"
+	if ! cmp -s "$TMP/expected" "$TMP/edges"
+	then
+		echo "FAIL $unique: 2 ranks optimized $(sort -u "$TMP/edges" | wc -l) distinct of $top graphs ($(wc -l < "$TMP/edges") in total)"
+		status=1
+	fi
+done
+
+OMP_NUM_THREADS=1 $MPIEXEC -np 1 "$OPTIMIZER" -p 0 -c 0 -u "$TMP/graphs.txt" 2> "$TMP/err1" > /dev/null
+one=$(grep "Structure classes" "$TMP/err1")
+two=$(grep "Structure classes" "$TMP/err2")
+if [ -z "$one" ] || [ "$one" != "$two" ]
+then
+	echo "FAIL -u: '$two' on 2 ranks, '$one' on 1 rank"
+	status=1
+fi
+
+exit $status
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Просеянное множество графов не должно зависеть от числа потоков:
+# от него зависит startPort заготовок, а с ним и число рёбер, назначаемых перебором.
+# Вывод не должен содержать повторов, а число графов должно совпасть с полным
+# перебором всех графов без отсечений (для обеих матриц оно одинаково).
+#
+# Аргумент: путь к sifter
+
+SIFTER=${1:-./sifter}
+TMP=${TMPDIR:-/tmp}/sifter_threads.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+ALL="1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1"
+CNOT="1 1 0 0 1 1 0 0 0 0 1 1 0 0 1 1"
+
+status=0
+for case in "4 2 0 0:64" "4 3 0 0:4480" "4 2 1 0:4480"
+do
+	size=${case%:*}
+	expected=${case#*:}
+
+	for matrix in "$ALL" "$CNOT"
+	do
+		for threads in 1 2 8
+		do
+			OMP_NUM_THREADS=$threads "$SIFTER" -p 0 $size $matrix 2>/dev/null | tail -n +2 | sort > "$TMP/$threads" || exit 1
+
+			if [ -n "$(uniq -d "$TMP/$threads")" ]
+			then
+				echo "FAIL $size [$matrix]: duplicate graphs at $threads threads"
+				status=1
+			fi
+		done
+
+		for threads in 2 8
+		do
+			if ! cmp -s "$TMP/1" "$TMP/$threads"
+			then
+				echo "FAIL $size [$matrix]: $threads threads differ from 1 thread"
+				status=1
+			fi
+		done
+
+		count=$(wc -l < "$TMP/1")
+		if [ "$count" -ne "$expected" ]
+		then
+			echo "FAIL $size [$matrix]: $count graphs, expected $expected"
+			status=1
+		fi
+	done
+done
+
+exit $status
@@ -0,0 +1,74 @@
+#ifndef TRACE_CPP
+#define TRACE_CPP
+
+#include "trace.hpp"
+
+#if QSS_TRACE >= 1
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+
+//! Событие: имя и интервал в наносекундах
+struct trace_event_t
+{
+	const char *name;
+	u_int64_t start;
+	u_int64_t end;
+};
+
+//! Буфер потока. Пишет в него только его поток, TRACE_DUMP() читает после параллельных областей
+struct trace_buffer_t
+{
+	uint tid;
+	std::vector<trace_event_t> events;
+};
+
+//! Буферы всех потоков: живут до конца программы, даже если поток завершился
+static std::vector<std::unique_ptr<trace_buffer_t> > trace_buffers;
+static std::mutex trace_lock;
+
+void trace_record(const char *_name, u_int64_t _start, u_int64_t _end)
+{
+	// Блокировка нужна только при первом событии потока
+	static thread_local trace_buffer_t *buffer = NULL;
+	if(buffer == NULL)
+	{
+		std::lock_guard<std::mutex> guard(trace_lock);
+		trace_buffers.emplace_back(new trace_buffer_t);
+		buffer = trace_buffers.back().get();
+		buffer->tid = trace_buffers.size() - 1;
+		buffer->events.reserve(1 << 12);
+	}
+
+	buffer->events.push_back(trace_event_t{_name, _start, _end});
+}
+
+bool trace_dump(const std::string &_file, int _pid)
+{
+	std::lock_guard<std::mutex> guard(trace_lock);
+
+	FILE *f = fopen(_file.c_str(), "w");
+	if(f == NULL) return false;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"rank %d\"}}", _pid, _pid);
+
+	for(auto &b : trace_buffers)
+	{
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"thread %u\"}}",
+			_pid, b->tid, b->tid);
+
+		for(auto &e : b->events)
+		fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+			e.name, _pid, b->tid, e.start * 1e-3, (e.end - e.start) * 1e-3);
+	}
+
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
+
+#endif
+
+#endif //! TRACE_CPP
@@ -0,0 +1,76 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <string>
+#include <chrono>
+#include <stdlib.h>
+
+/*
+ * @brief Трассировка интервалов для chrome://tracing и Perfetto.
+ *  Уровень задаётся при сборке, как SIFTER_DEBUG_LOG (-DQSS_TRACE=1):
+ *   0 - макросы пустые, трассировки нет (по умолчанию);
+ *   1 - фазы программ, заготовки и поддеревья перебора, запуски NLopt, сброс вывода;
+ *   2 - ещё graph::set_edges() и graph::sift() каждого графа. Событий столько же,
+ *       сколько графов, поэтому только для небольших запусков.
+ *
+ *  TRACE_SCOPE(имя) отмечает интервал до конца блока. Событие пишется в буфер
+ *  своего потока без блокировок; TRACE_DUMP() в конце программы сохраняет буферы
+ *  всех потоков одним файлом JSON ("ph": "X", время в микросекундах).
+ *  Имя - строковый литерал: в буфере хранится только указатель.
+ */
+#ifndef QSS_TRACE
+#define QSS_TRACE 0
+#endif
+
+#if QSS_TRACE >= 1
+
+//! Наносекунды с первого обращения к трассировке
+inline u_int64_t trace_now()
+{
+	static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+//! Дописывает интервал [_start, _end) в буфер текущего потока
+void trace_record(const char *_name, u_int64_t _start, u_int64_t _end);
+
+/*
+ * @brief Сохраняет события всех потоков
+ *
+ * @param _file		Имя файла
+ * @param _pid		Номер процесса в файле (номер процесса MPI)
+ *
+ * @return false, если файл не удалось записать
+ */
+bool trace_dump(const std::string &_file, int _pid);
+
+//! Интервал от создания до разрушения объекта
+class trace_scope {
+public:
+	explicit trace_scope(const char *_name) : name(_name), start(trace_now()) {}
+	~trace_scope() { trace_record(name, start, trace_now()); }
+
+protected:
+	const char *name;
+	u_int64_t start;
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(_name) trace_scope TRACE_JOIN(trace_scope_, __LINE__)(_name)
+#define TRACE_DUMP(_file, _pid) trace_dump(_file, _pid)
+
+#else
+
+#define TRACE_SCOPE(_name)
+#define TRACE_DUMP(_file, _pid)
+
+#endif
+
+#if QSS_TRACE >= 2
+#define TRACE_SCOPE_GRAPH(_name) TRACE_SCOPE(_name)
+#else
+#define TRACE_SCOPE_GRAPH(_name)
+#endif
+
+#endif //! TRACE_HPP